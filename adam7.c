@@ -0,0 +1,290 @@
+#include "png.h"
+
+#include <pthread.h>
+
+static const unsigned char png_adam7_x0[7] = {0, 4, 0, 2, 0, 1, 0};
+static const unsigned char png_adam7_y0[7] = {0, 0, 4, 0, 2, 0, 1};
+static const unsigned char png_adam7_dx[7] = {8, 8, 4, 4, 2, 2, 1};
+static const unsigned char png_adam7_dy[7] = {8, 8, 8, 4, 4, 2, 2};
+
+struct png_adam7_job {
+    const struct png_adam7_pass *pass;
+    const unsigned char *inflated;
+    unsigned char *image;
+    unsigned char *filtered;
+    const unsigned char *zero;
+    unsigned char *candidates;
+    const struct png_effects *effects;
+    uint64_t row_base;
+    unsigned char bpp;
+    unsigned char policy;
+    _Bool unfilter;
+    _Bool refilter;
+    int err;
+};
+
+size_t png_adam7_passes(const struct png_stats *stats, struct png_adam7_pass passes[7]) {
+    unsigned int bits = png_pixel_bits(stats);
+    size_t offset = 0, image_offset = 0;
+    int p;
+
+    for (p = 0; p < 7; p++) {
+        passes[p].width = stats->width > png_adam7_x0[p] ? (stats->width - png_adam7_x0[p] + png_adam7_dx[p] - 1) / png_adam7_dx[p] : 0;
+        passes[p].height = stats->height > png_adam7_y0[p] ? (stats->height - png_adam7_y0[p] + png_adam7_dy[p] - 1) / png_adam7_dy[p] : 0;
+        passes[p].stride = ((size_t) passes[p].width * bits + 7) / 8;
+        passes[p].offset = offset;
+        passes[p].image_offset = image_offset;
+
+        if (passes[p].width && passes[p].height) {
+            offset += (passes[p].stride + 1) * passes[p].height;
+            image_offset += passes[p].stride * passes[p].height;
+        }
+    }
+
+    return offset;
+}
+
+static void *png_adam7_worker(void *arg) {
+    struct png_adam7_job *job = (struct png_adam7_job *) arg;
+    const struct png_adam7_pass *pass = job->pass;
+    const unsigned char *in = job->inflated + pass->offset;
+    unsigned char *row = job->image + pass->image_offset;
+    unsigned char *out = job->filtered + pass->offset;
+    const unsigned char *prev;
+    png_unfilter_fn kernels[5];
+    uint32_t h;
+
+    png_unfilter_kernels(job->bpp, kernels);
+    for (h = 0, prev = job->zero; job->unfilter && h < pass->height; h++) {
+        if (in[0] > PNG_FILTER_PAETH) {
+            job->err = PNG_ERR_FILTER;
+            return NULL;
+        }
+
+        memcpy(row, in + 1, pass->stride);
+        kernels[in[0]](row, prev, pass->stride, job->bpp);
+
+        in += pass->stride + 1;
+        prev = row;
+        row += pass->stride;
+    }
+
+    if (job->refilter) {
+        row = job->image + pass->image_offset;
+        for (h = 0, prev = job->zero; h < pass->height; h++) {
+            if (NULL != job->effects) {
+                png_effects_row(job->effects, job->row_base + h, out, row, prev, pass->stride, job->bpp, job->policy,
+                                job->candidates);
+            } else if (job->policy > PNG_FILTER_PAETH) {
+                png_filter_row_adaptive(out, row, prev, pass->stride, job->bpp, job->policy, job->candidates);
+            } else {
+                png_filter_row(out, row, prev, pass->stride, job->bpp, job->policy);
+            }
+
+            out += pass->stride + 1;
+            prev = row;
+            row += pass->stride;
+        }
+    }
+
+    return NULL;
+}
+
+static void png_adam7_scatter(const struct png_stats *stats, const struct png_adam7_pass *pass, int p,
+                              const unsigned char *sub, unsigned char *image, size_t stride) {
+    unsigned int bits = png_pixel_bits(stats), bytes = bits / 8, shift, value;
+    uint32_t x, y, px, py;
+    size_t src, dst;
+
+    for (y = 0; y < pass->height; y++) {
+        py = png_adam7_y0[p] + y * png_adam7_dy[p];
+        for (x = 0; x < pass->width; x++) {
+            px = png_adam7_x0[p] + x * png_adam7_dx[p];
+            if (bits >= 8) {
+                memcpy(image + py * stride + (size_t) px * bytes, sub + y * pass->stride + (size_t) x * bytes, bytes);
+                continue;
+            }
+
+            src = (size_t) x * bits;
+            shift = 8 - bits - (unsigned int) (src & 7);
+            value = (sub[y * pass->stride + src / 8] >> shift) & ((1u << bits) - 1);
+
+            dst = (size_t) px * bits;
+            shift = 8 - bits - (unsigned int) (dst & 7);
+            image[py * stride + dst / 8] &= (unsigned char) ~(((1u << bits) - 1) << shift);
+            image[py * stride + dst / 8] |= (unsigned char) (value << shift);
+        }
+    }
+}
+
+static int png_adam7_run(struct png_ctx *ctx, const struct png_stats *stats, const struct png_adam7_pass passes[7],
+                         unsigned char policy, _Bool unfilter, _Bool refilter, unsigned char *image) {
+
+    struct png_adam7_job jobs[7];
+    pthread_t workers[7];
+    _Bool started[7];
+    int p, err = PNG_OK;
+
+    for (p = 6; p >= 0; p--) {
+        jobs[p].pass = &passes[p];
+        jobs[p].inflated = ctx->inflated.data;
+        jobs[p].image = image;
+        jobs[p].filtered = ctx->filtered.data;
+        jobs[p].bpp = stats->bit_depth;
+        jobs[p].policy = policy;
+        jobs[p].unfilter = unfilter;
+        jobs[p].refilter = refilter;
+        jobs[p].effects = refilter && ctx->effects.active ? &ctx->effects : NULL;
+        jobs[p].row_base = (uint64_t) (p + 1) << 32;
+        jobs[p].err = PNG_OK;
+
+        started[p] = 0;
+        if (passes[p].width == 0 || passes[p].height == 0) {
+            continue;
+        }
+
+        jobs[p].zero = (const unsigned char *) png_arena_calloc(&ctx->arena, passes[p].stride);
+        jobs[p].candidates = (unsigned char *) png_arena_alloc(&ctx->arena, 5 * passes[p].stride);
+        if (NULL == jobs[p].zero || NULL == jobs[p].candidates) {
+            jobs[p].err = PNG_ERR_NOMEM;
+            continue;
+        }
+        if (p == 6 || pthread_create(&workers[p], NULL, png_adam7_worker, &jobs[p]) != 0) {
+            png_adam7_worker(&jobs[p]);
+        } else {
+            started[p] = 1;
+        }
+    }
+
+    for (p = 0; p < 7; p++) {
+        if (started[p]) {
+            pthread_join(workers[p], NULL);
+        }
+        if (PNG_OK != jobs[p].err && PNG_OK == err) {
+            err = jobs[p].err;
+        }
+    }
+
+    return err;
+}
+
+static int png_adam7_prepare(struct png_ctx *ctx, const struct png_stats *stats, struct png_adam7_pass passes[7],
+                             const unsigned char *cached, unsigned char **image) {
+
+    size_t total = png_adam7_passes(stats, passes), image_size, h;
+    int p;
+
+    image_size = passes[6].image_offset + passes[6].stride * passes[6].height;
+    if (NULL == cached && ctx->inflated.len < total) {
+        return PNG_ERR_TRUNCATED;
+    }
+    if ((NULL == cached && !png_buffer_reserve(&ctx->image, image_size)) || !png_buffer_reserve(&ctx->filtered, total)) {
+        return PNG_ERR_NOMEM;
+    }
+    *image = NULL == cached ? ctx->image.data : (unsigned char *) cached;
+
+    if (NULL == cached && png_trace_active) {
+        for (p = 0; p < 7; p++) {
+            if (passes[p].width == 0) {
+                continue;
+            }
+            for (h = 0; h < passes[p].height; h++) {
+                PNG_TRACE_FILTER(ctx->inflated.data[passes[p].offset + h * (passes[p].stride + 1)])
+            }
+        }
+    }
+
+    return PNG_OK;
+}
+
+static int png_adam7_merge(struct png_ctx *ctx, const struct png_stats *stats, const struct png_adam7_pass passes[7],
+                           const unsigned char *image) {
+
+    size_t stride = png_row_stride(stats), y;
+    int p;
+
+    if (!png_buffer_reserve(&ctx->deinterlaced, stride * stats->height)) {
+        return PNG_ERR_NOMEM;
+    }
+    /* the scatter only sets the bits of real pixels, so clear the padding left by an earlier image */
+    if ((size_t) stats->width * png_pixel_bits(stats) % 8) {
+        for (y = 0; y < stats->height; y++) {
+            ctx->deinterlaced.data[y * stride + stride - 1] = 0;
+        }
+    }
+    for (p = 0; p < 7; p++) {
+        if (passes[p].width && passes[p].height) {
+            png_adam7_scatter(stats, &passes[p], p, image + passes[p].image_offset, ctx->deinterlaced.data, stride);
+        }
+    }
+    ctx->deinterlaced.len = stride * stats->height;
+
+    return PNG_OK;
+}
+
+int png_adam7_deinterlace(struct png_ctx *ctx, const struct png_stats *stats, const unsigned char *cached) {
+    struct png_adam7_pass passes[7];
+    unsigned char *image;
+    int err;
+
+    if (PNG_OK != (err = png_adam7_prepare(ctx, stats, passes, cached, &image))) {
+        return err;
+    }
+
+    PNG_TRACE_BEGIN(PNG_STAGE_UNFILTER, ctx->inflated.len)
+    err = png_adam7_run(ctx, stats, passes, PNG_FILTER_NONE, NULL == cached, 0, image);
+    PNG_TRACE_END(PNG_STAGE_UNFILTER, png_row_stride(stats) * stats->height)
+    if (PNG_OK != err) {
+        return err;
+    }
+
+    return png_adam7_merge(ctx, stats, passes, image);
+}
+
+int png_adam7_glitch(struct png_ctx *ctx, const struct png_stats *stats, const struct png_opts *opts, const unsigned char *cached) {
+    struct png_adam7_pass passes[7];
+    unsigned char *image;
+    size_t raw;
+    int err;
+
+    if (PNG_OK != (err = png_adam7_prepare(ctx, stats, passes, cached, &image))) {
+        return err;
+    }
+
+    PNG_TRACE_BEGIN(PNG_STAGE_UNFILTER, ctx->inflated.len)
+    err = png_adam7_run(ctx, stats, passes, opts->filter_method, NULL == cached, !opts->progressive, image);
+    PNG_TRACE_END(PNG_STAGE_UNFILTER, png_cache_image_size(stats))
+    if (PNG_OK != err) {
+        return err;
+    }
+
+    if (!opts->progressive) {
+        ctx->filtered.len = passes[6].offset + (passes[6].stride + 1) * passes[6].height;
+        return PNG_OK;
+    }
+
+    if (PNG_OK != (err = png_adam7_merge(ctx, stats, passes, image))) {
+        return err;
+    }
+
+    raw = ctx->deinterlaced.len;
+    PNG_TRACE_BEGIN(PNG_STAGE_REFILTER, raw)
+    if (opts->filter_method > PNG_FILTER_PAETH) {
+        err = png_filter_image_adaptive(ctx, ctx->deinterlaced.data, raw, stats, opts->filter_method, &ctx->filtered);
+    } else {
+        err = png_filter_image_fixed(ctx, ctx->deinterlaced.data, raw, stats, opts->filter_method, &ctx->filtered);
+    }
+    PNG_TRACE_END(PNG_STAGE_REFILTER, ctx->filtered.len)
+
+    return err;
+}
+
+void png_adam7_ihdr(const struct png_index *index, unsigned char ihdr[25]) {
+    uint32_t checksum;
+
+    memcpy(ihdr, index->base + index->chunks[0].offset, 25);
+    ihdr[8 + 12] = 0;
+
+    checksum = byteswap_ulong(png_crc32(0, ihdr + 4, 17));
+    memcpy(ihdr + 21, &checksum, 4);
+}
@@ -0,0 +1,87 @@
+#include "png.h"
+
+#define PNG_ARENA_ALIGN 16
+#define PNG_ARENA_HEADER ((sizeof(struct png_arena_block) + PNG_ARENA_ALIGN - 1) & ~(size_t) (PNG_ARENA_ALIGN - 1))
+
+struct png_arena_block {
+    struct png_arena_block *next;
+    size_t capacity;
+    size_t used;
+};
+
+static struct png_arena_block *png_arena_grow(struct png_arena *arena, size_t capacity) {
+    struct png_arena_block *block = (struct png_arena_block *) png_malloc(PNG_ARENA_HEADER + capacity);
+    if (NULL == block) {
+        return NULL;
+    }
+
+    block->next = arena->head;
+    block->capacity = capacity;
+    block->used = 0;
+    arena->head = block;
+
+    return block;
+}
+
+void *png_arena_alloc(struct png_arena *arena, size_t size) {
+    struct png_arena_block *block = arena->head;
+    size_t capacity;
+    void *ptr;
+
+    size = (size + PNG_ARENA_ALIGN - 1) & ~(size_t) (PNG_ARENA_ALIGN - 1);
+
+    if (NULL == block || block->capacity - block->used < size) {
+        capacity = block ? block->capacity * 2 : CHUNK * 4;
+        if (capacity < size) {
+            capacity = size;
+        }
+        if (NULL == (block = png_arena_grow(arena, capacity))) {
+            return NULL;
+        }
+    }
+
+    ptr = (unsigned char *) block + PNG_ARENA_HEADER + block->used;
+    block->used += size;
+
+    return ptr;
+}
+
+void *png_arena_calloc(struct png_arena *arena, size_t size) {
+    void *ptr = png_arena_alloc(arena, size);
+    if (NULL != ptr) {
+        memset(ptr, 0, size);
+    }
+    return ptr;
+}
+
+void png_arena_reset(struct png_arena *arena) {
+    struct png_arena_block *block = arena->head, *next;
+    size_t total = 0;
+
+    if (NULL == block) {
+        return;
+    }
+    if (NULL == block->next) {
+        block->used = 0;
+        return;
+    }
+
+    for (; NULL != block; block = next) {
+        next = block->next;
+        total += block->capacity;
+        free(block);
+    }
+    arena->head = NULL;
+
+    png_arena_grow(arena, total);
+}
+
+void png_arena_free(struct png_arena *arena) {
+    struct png_arena_block *block, *next;
+
+    for (block = arena->head; NULL != block; block = next) {
+        next = block->next;
+        free(block);
+    }
+    arena->head = NULL;
+}
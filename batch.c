@@ -0,0 +1,266 @@
+#include "png.h"
+
+#include <dirent.h>
+#include <glob.h>
+#include <pthread.h>
+#include <time.h>
+
+struct png_batch {
+    char **inputs;
+    size_t count;
+    size_t capacity;
+
+    const char *outdir;
+    const struct png_opts *opts;
+
+    pthread_mutex_t lock;
+    size_t next;
+    size_t done;
+    size_t failed;
+    size_t bytes_in;
+    size_t bytes_out;
+};
+
+static void png_batch_add(struct png_batch *batch, const char *path) {
+    char **temp;
+
+    if (batch->count == batch->capacity) {
+        batch->capacity = batch->capacity ? batch->capacity * 2 : 64;
+        temp = (char **) realloc(batch->inputs, batch->capacity * sizeof(*batch->inputs));
+        CHALLOC(temp)
+        batch->inputs = temp;
+    }
+
+    batch->inputs[batch->count] = strdup(path);
+    CHALLOC(batch->inputs[batch->count])
+    batch->count++;
+}
+
+static _Bool png_batch_is_png(const char *path) {
+    size_t len = strlen(path);
+    return len > 4 && (!strcmp(path + len - 4, ".png") || !strcmp(path + len - 4, ".PNG"));
+}
+
+static void png_batch_scan_dir(struct png_batch *batch, const char *dir) {
+    DIR *d;
+    struct dirent *entry;
+    char path[4096];
+
+    if (NULL == (d = opendir(dir))) {
+        fprintf(stderr, "Failed to open directory '%s'\n", dir);
+        return;
+    }
+
+    while (NULL != (entry = readdir(d))) {
+        if (!png_batch_is_png(entry->d_name)) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+        png_batch_add(batch, path);
+    }
+
+    closedir(d);
+}
+
+static void png_batch_scan_manifest(struct png_batch *batch, const char *manifest) {
+    FILE *f;
+    char line[4096];
+    size_t len;
+
+    if (NULL == (f = fopen(manifest, "r"))) {
+        fprintf(stderr, "Failed to open manifest '%s'\n", manifest);
+        return;
+    }
+
+    while (NULL != fgets(line, sizeof(line), f)) {
+        len = strcspn(line, "\r\n");
+        line[len] = '\0';
+        if (len == 0 || line[0] == '#') {
+            continue;
+        }
+        png_batch_add(batch, line);
+    }
+
+    fclose(f);
+}
+
+static void png_batch_scan(struct png_batch *batch, const char *source) {
+    struct stat st;
+    glob_t matches;
+    size_t i;
+
+    if (strpbrk(source, "*?[") != NULL) {
+        if (glob(source, 0, NULL, &matches) == 0) {
+            for (i = 0; i < matches.gl_pathc; i++) {
+                png_batch_add(batch, matches.gl_pathv[i]);
+            }
+        }
+        globfree(&matches);
+        return;
+    }
+
+    if (stat(source, &st) == -1) {
+        fprintf(stderr, "Failed to stat '%s'\n", source);
+        return;
+    }
+
+    if (S_ISDIR(st.st_mode)) {
+        png_batch_scan_dir(batch, source);
+    } else if (png_batch_is_png(source)) {
+        png_batch_add(batch, source);
+    } else {
+        png_batch_scan_manifest(batch, source);
+    }
+}
+
+static const char *png_batch_name(const char *path) {
+    const char *name = strrchr(path, '/');
+    return (NULL == name) ? path : name + 1;
+}
+
+static int png_batch_name_cmp(const void *a, const void *b) {
+    return strcmp(png_batch_name(*(char *const *) a), png_batch_name(*(char *const *) b));
+}
+
+/* every output is OUTDIR/basename, so two inputs with one basename would overwrite each other */
+static _Bool png_batch_unique(const struct png_batch *batch) {
+    char **sorted = (char **) malloc(batch->count * sizeof(*sorted));
+    _Bool unique = 1;
+    size_t i;
+    CHALLOC(sorted)
+
+    memcpy(sorted, batch->inputs, batch->count * sizeof(*sorted));
+    qsort(sorted, batch->count, sizeof(*sorted), png_batch_name_cmp);
+    for (i = 1; i < batch->count; i++) {
+        if (!strcmp(png_batch_name(sorted[i - 1]), png_batch_name(sorted[i]))) {
+            fprintf(stderr, "Inputs '%s' and '%s' would both be written to '%s/%s'\n", sorted[i - 1], sorted[i],
+                    batch->outdir, png_batch_name(sorted[i]));
+            unique = 0;
+        }
+    }
+
+    free(sorted);
+    return unique;
+}
+
+static size_t png_batch_file_size(const char *path) {
+    struct stat st;
+    return stat(path, &st) == -1 ? 0 : (size_t) st.st_size;
+}
+
+static void *png_batch_worker(void *arg) {
+    struct png_batch *batch = (struct png_batch *) arg;
+    struct png_ctx *ctx = png_ctx_create();
+    CHALLOC(ctx)
+
+    const char *input;
+    char output[4096];
+    size_t index, bytes_in, bytes_out;
+    int err;
+
+    for (;;) {
+        pthread_mutex_lock(&batch->lock);
+        index = batch->next++;
+        pthread_mutex_unlock(&batch->lock);
+
+        if (index >= batch->count) {
+            break;
+        }
+
+        input = batch->inputs[index];
+        snprintf(output, sizeof(output), "%s/%s", batch->outdir, png_batch_name(input));
+
+        if (PNG_OK != (err = png_glitch_file(ctx, input, output, batch->opts))) {
+            fprintf(stderr, "Failed to glitch '%s': %s\n", input, png_strerror(err));
+        }
+        bytes_in = PNG_OK == err ? png_batch_file_size(input) : 0;
+        bytes_out = PNG_OK == err ? png_batch_file_size(output) : 0;
+
+        pthread_mutex_lock(&batch->lock);
+        if (PNG_OK == err) {
+            batch->done++;
+            batch->bytes_in += bytes_in;
+            batch->bytes_out += bytes_out;
+        } else {
+            batch->failed++;
+        }
+        pthread_mutex_unlock(&batch->lock);
+    }
+
+    png_ctx_destroy(ctx);
+    return NULL;
+}
+
+int png_batch(char **sources, int count, const char *outdir, unsigned int threads, const struct png_opts *opts) {
+    struct png_batch batch;
+    struct timespec begin, end;
+    pthread_t *workers;
+    unsigned int i;
+    double elapsed;
+
+    memset(&batch, 0, sizeof(batch));
+    batch.outdir = outdir;
+    batch.opts = opts;
+    pthread_mutex_init(&batch.lock, NULL);
+
+    for (i = 0; i < (unsigned int) count; i++) {
+        png_batch_scan(&batch, sources[i]);
+    }
+
+    if (batch.count == 0) {
+        fputs("No input images found\n", stderr);
+        pthread_mutex_destroy(&batch.lock);
+        return 1;
+    }
+    if (!png_batch_unique(&batch)) {
+        for (i = 0; i < batch.count; i++) {
+            free(batch.inputs[i]);
+        }
+        free(batch.inputs);
+        pthread_mutex_destroy(&batch.lock);
+        return 1;
+    }
+
+    if (threads == 0) {
+        threads = 1;
+    }
+    if (threads > batch.count) {
+        threads = batch.count;
+    }
+
+    workers = (pthread_t *) calloc(threads, sizeof(*workers));
+    CHALLOC(workers)
+
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+
+    for (i = 0; i < threads; i++) {
+        if (pthread_create(&workers[i], NULL, png_batch_worker, &batch) != 0) {
+            fputs("Failed to start worker thread\n", stderr);
+            exit(1);
+        }
+    }
+    for (i = 0; i < threads; i++) {
+        pthread_join(workers[i], NULL);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    elapsed = (double) (end.tv_sec - begin.tv_sec) + (double) (end.tv_nsec - begin.tv_nsec) / 1e9;
+    if (elapsed <= 0) {
+        elapsed = 1e-9;
+    }
+
+    fprintf(stderr, "%zu images (%zu failed) on %u threads in %.3f s: %.2f images/s, %.2f MB/s in, %.2f MB/s out\n",
+            batch.done, batch.failed, threads, elapsed,
+            (double) batch.done / elapsed,
+            (double) batch.bytes_in / elapsed / 1e6,
+            (double) batch.bytes_out / elapsed / 1e6);
+
+    for (i = 0; i < batch.count; i++) {
+        free(batch.inputs[i]);
+    }
+    free(batch.inputs);
+    free(workers);
+    pthread_mutex_destroy(&batch.lock);
+
+    return batch.failed != 0;
+}
@@ -0,0 +1,352 @@
+#include "png.h"
+
+#include <getopt.h>
+#include <time.h>
+
+#define BENCH_STAGES 9
+#define BENCH_IDAT_SMALL 8192
+
+#define BENCH_CHECK(x) {int err_ = (x); if (PNG_OK != err_) {fprintf(stderr, "%s: %s\n", input, png_strerror(err_));exit(1);}}
+
+enum bench_stage {
+    STAGE_PARSE, STAGE_CRC, STAGE_GATHER, STAGE_INFLATE, STAGE_UNFILTER,
+    STAGE_REFILTER, STAGE_DEFLATE, STAGE_FLATTEN, STAGE_WRITE
+};
+
+static const char *bench_stage_names[BENCH_STAGES] = {
+        "parse", "crc", "gather", "inflate", "unfilter", "refilter", "deflate", "flatten", "write"
+};
+
+static const struct {
+    unsigned char color_type;
+    unsigned char bit_depth;
+} bench_formats[] = {
+        {0, 1}, {0, 2}, {0, 4}, {0, 8}, {0, 16},
+        {2, 8}, {2, 16},
+        {3, 1}, {3, 2}, {3, 4}, {3, 8},
+        {4, 8}, {4, 16},
+        {6, 8}, {6, 16},
+};
+
+static const struct {
+    const char *name;
+    uint32_t width;
+    uint32_t height;
+} bench_tiers[] = {
+        {"thumb",  64,    64},
+        {"small",  512,   512},
+        {"medium", 2048,  2048},
+        {"large",  6000,  4000},
+        {"huge",   10240, 10240},
+};
+
+#define BENCH_FORMATS (sizeof(bench_formats) / sizeof(*bench_formats))
+#define BENCH_TIERS (sizeof(bench_tiers) / sizeof(*bench_tiers))
+
+struct bench_result {
+    double seconds[BENCH_STAGES];
+    size_t bytes[BENCH_STAGES];
+};
+
+static double bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+static uint32_t bench_rand(uint32_t *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+static _Bool bench_generate(const char *path, uint32_t width, uint32_t height, unsigned char color_type,
+                            unsigned char bit_depth, _Bool many_idat) {
+
+    struct png_stats stats = {width, height, bit_depth, color_type, 0, 0, 0};
+    struct png_stats pixel = {1, 1, bit_depth, color_type, 0, 0, 0};
+    struct png_stats ihdr = stats;
+    size_t stride = png_row_stride(&stats);
+    size_t raw_len = (stride + 1) * height;
+    unsigned char bpp = (unsigned char) png_row_stride(&pixel);
+    uint32_t seed = width * 2654435761u ^ (color_type << 8 | bit_depth), h;
+    unsigned char palette[768];
+    unsigned char *row, *prev, *swap, *raw, *compressed;
+    uLongf compressed_len;
+    size_t c, offset, len;
+    int fd, i;
+    _Bool ok = 1;
+
+    row = (unsigned char *) calloc(stride, 1);
+    CHALLOC(row)
+    prev = (unsigned char *) calloc(stride, 1);
+    CHALLOC(prev)
+    raw = (unsigned char *) malloc(raw_len);
+    CHALLOC(raw)
+
+    for (h = 0; h < height; h++) {
+        for (c = 0; c < stride; c++) {
+            row[c] = (unsigned char) ((c * 3 + h) ^ (bench_rand(&seed) & 0x0f));
+        }
+        png_filter_row(raw + h * (stride + 1), row, prev, stride, bpp, bench_rand(&seed) % 5);
+
+        swap = prev;
+        prev = row;
+        row = swap;
+    }
+
+    compressed_len = compressBound(raw_len);
+    compressed = (unsigned char *) malloc(compressed_len);
+    CHALLOC(compressed)
+    if (Z_OK != compress2(compressed, &compressed_len, raw, raw_len, Z_DEFAULT_COMPRESSION)) {
+        fputs("Failed to compress the synthetic image\n", stderr);
+        exit(1);
+    }
+    free(raw);
+    free(row);
+    free(prev);
+
+    if ((fd = open(path, O_CREAT | O_TRUNC | O_WRONLY | O_BINARY, S_IREAD | S_IWRITE)) == -1) {
+        fprintf(stderr, "Failed to open file '%s'\n", path);
+        free(compressed);
+        return 0;
+    }
+
+    ihdr.width = byteswap_ulong(width);
+    ihdr.height = byteswap_ulong(height);
+    ok = png_write_all(fd, (const unsigned char *) "\x89PNG\r\n\x1a\n", 8) &&
+         png_write_chunk(fd, (const unsigned char *) "IHDR", (const unsigned char *) &ihdr, sizeof(ihdr));
+
+    if (ok && color_type == 3) {
+        for (i = 0; i < 768; i++) {
+            palette[i] = (unsigned char) (i * 7);
+        }
+        ok = png_write_chunk(fd, (const unsigned char *) "PLTE", palette, 3 * (1 << (bit_depth < 8 ? bit_depth : 8)));
+    }
+
+    for (offset = 0; ok && offset < compressed_len; offset += len) {
+        len = compressed_len - offset;
+        if (many_idat && len > BENCH_IDAT_SMALL) {
+            len = BENCH_IDAT_SMALL;
+        }
+        ok = png_write_chunk(fd, (const unsigned char *) "IDAT", compressed + offset, (uint32_t) len);
+    }
+
+    ok = ok && png_write_chunk(fd, (const unsigned char *) "IEND", NULL, 0);
+
+    close(fd);
+    free(compressed);
+
+    return ok;
+}
+
+static void bench_min(struct bench_result *best, const struct bench_result *run, int rep) {
+    int s;
+    for (s = 0; s < BENCH_STAGES; s++) {
+        if (rep == 0 || run->seconds[s] < best->seconds[s]) {
+            best->seconds[s] = run->seconds[s];
+        }
+        best->bytes[s] = run->bytes[s];
+    }
+}
+
+static _Bool bench_image(struct png_ctx *ctx, const char *input, const char *output, struct bench_result *res) {
+    struct png_index index;
+    struct png_stats stats;
+    struct png_emitter emitter;
+    unsigned char *gathered;
+    size_t i, idat_len = 0, chunk_bytes = 0, decompressed_len, reconstructed_len;
+    volatile uint32_t sink = 0;
+    double t;
+    int fd;
+
+    memset(res, 0, sizeof(*res));
+    memset(&index, 0, sizeof(index));
+    memset(&emitter, 0, sizeof(emitter));
+
+    if (PNG_OK != png_index_open(&index, input)) {
+        return 0;
+    }
+
+    t = bench_now();
+    if (PNG_OK != png_index_parse(&index)) {
+        png_index_free(&index);
+        return 0;
+    }
+    res->seconds[STAGE_PARSE] = bench_now() - t;
+    res->bytes[STAGE_PARSE] = index.size;
+
+    png_index_stats(&index, &stats);
+
+    t = bench_now();
+    for (i = 0; i < index.count; i++) {
+        sink ^= png_crc32(0, index.base + index.chunks[i].offset + 4, index.chunks[i].len + 4);
+        chunk_bytes += index.chunks[i].len + 4;
+    }
+    res->seconds[STAGE_CRC] = bench_now() - t;
+    res->bytes[STAGE_CRC] = chunk_bytes;
+
+    for (i = index.idat_first; i < index.idat_last; i++) {
+        idat_len += index.chunks[i].len;
+    }
+    t = bench_now();
+    gathered = (unsigned char *) malloc(idat_len ? idat_len : 1);
+    CHALLOC(gathered)
+    for (i = index.idat_first, idat_len = 0; i < index.idat_last; i++) {
+        memcpy(gathered + idat_len, index.chunks[i].data, index.chunks[i].len);
+        idat_len += index.chunks[i].len;
+    }
+    res->seconds[STAGE_GATHER] = bench_now() - t;
+    res->bytes[STAGE_GATHER] = idat_len;
+    free(gathered);
+
+    t = bench_now();
+    BENCH_CHECK(png_index_decompress(ctx, &index, &ctx->inflated))
+    decompressed_len = ctx->inflated.len;
+    res->seconds[STAGE_INFLATE] = bench_now() - t;
+    res->bytes[STAGE_INFLATE] = idat_len;
+
+    reconstructed_len = decompressed_len - stats.height;
+    t = bench_now();
+    BENCH_CHECK(png_reconstruct_image(ctx, ctx->inflated.data, reconstructed_len, &stats, &ctx->image))
+    res->seconds[STAGE_UNFILTER] = bench_now() - t;
+    res->bytes[STAGE_UNFILTER] = decompressed_len;
+
+    t = bench_now();
+    BENCH_CHECK(png_filter_image_fixed(ctx, ctx->image.data, reconstructed_len, &stats, 4, &ctx->filtered))
+    res->seconds[STAGE_REFILTER] = bench_now() - t;
+    res->bytes[STAGE_REFILTER] = reconstructed_len;
+
+    t = bench_now();
+    BENCH_CHECK(png_zlib_compress(ctx, ctx->filtered.data, ctx->filtered.len, &ctx->compressed))
+    res->seconds[STAGE_DEFLATE] = bench_now() - t;
+    res->bytes[STAGE_DEFLATE] = decompressed_len;
+
+    t = bench_now();
+    BENCH_CHECK(png_emit_build(&emitter, &index, NULL, ctx->compressed.data, ctx->compressed.len, 1 << 16))
+    res->seconds[STAGE_FLATTEN] = bench_now() - t;
+    res->bytes[STAGE_FLATTEN] = ctx->compressed.len;
+
+    if ((fd = open(output, O_CREAT | O_TRUNC | O_WRONLY | O_BINARY, S_IREAD | S_IWRITE)) == -1) {
+        fprintf(stderr, "Failed to open file '%s'\n", output);
+        exit(1);
+    }
+    t = bench_now();
+    if (!png_emit_write(fd, &emitter, 0)) {
+        fprintf(stderr, "Failed to write file '%s'\n", output);
+        exit(1);
+    }
+    res->seconds[STAGE_WRITE] = bench_now() - t;
+    res->bytes[STAGE_WRITE] = emitter.total;
+    close(fd);
+
+    png_emit_free(&emitter);
+    png_index_free(&index);
+
+    return 1;
+}
+
+static void usage(const char *name) {
+    printf("Usage: %s [--corpus DIR] [--max-tier thumb|small|medium|large|huge] [--reps N] [--json]\n", name);
+}
+
+int main(int argc, char *argv[]) {
+
+    static const struct option options[] = {
+            {"corpus",   required_argument, NULL, 'c'},
+            {"max-tier", required_argument, NULL, 't'},
+            {"reps",     required_argument, NULL, 'r'},
+            {"json",     no_argument,       NULL, 'j'},
+            {"help",     no_argument,       NULL, 'h'},
+            {NULL, 0,                       NULL, 0}
+    };
+
+    const char *corpus = "pnglitch-corpus";
+    size_t max_tier = 2, tier, format;
+    int reps = 3, rep, layout, s, opt;
+    _Bool json = 0;
+
+    while ((opt = getopt_long(argc, argv, "c:t:r:jh", options, NULL)) != -1) {
+        switch (opt) {
+            case 'c':
+                corpus = optarg;
+                break;
+            case 't':
+                for (max_tier = 0; max_tier < BENCH_TIERS && strcmp(bench_tiers[max_tier].name, optarg); max_tier++);
+                if (max_tier == BENCH_TIERS) {
+                    fprintf(stderr, "Unknown tier '%s'\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'r':
+                reps = (int) strtol(optarg, NULL, 10);
+                reps = reps > 0 ? reps : 1;
+                break;
+            case 'j':
+                json = 1;
+                break;
+            default:
+                usage(argv[0]);
+                exit(1);
+        }
+    }
+
+    mkdir(corpus, 0755);
+
+    struct png_ctx *ctx = png_ctx_create();
+    CHALLOC(ctx)
+    struct bench_result best, run;
+    char input[4096], output[4096];
+    struct stat st;
+
+    if (!json) {
+        printf("crc32 engine: %s, filter kernels: %s\n", png_crc32_engine(), png_filter_isa());
+        printf("%-28s %-9s %12s %10s %10s\n", "image", "stage", "bytes", "ns/byte", "MB/s");
+    }
+
+    for (tier = 0; tier <= max_tier; tier++) {
+        for (format = 0; format < BENCH_FORMATS; format++) {
+            for (layout = 0; layout < 2; layout++) {
+                snprintf(input, sizeof(input), "%s/%s-ct%d-bd%d-%s.png", corpus, bench_tiers[tier].name,
+                         bench_formats[format].color_type, bench_formats[format].bit_depth, layout ? "many" : "single");
+                snprintf(output, sizeof(output), "%s/out.png", corpus);
+
+                if (stat(input, &st) == -1 &&
+                    !bench_generate(input, bench_tiers[tier].width, bench_tiers[tier].height,
+                                    bench_formats[format].color_type, bench_formats[format].bit_depth, layout)) {
+                    exit(1);
+                }
+
+                for (rep = 0; rep < reps; rep++) {
+                    if (!bench_image(ctx, input, output, &run)) {
+                        fprintf(stderr, "Failed to benchmark '%s'\n", input);
+                        exit(1);
+                    }
+                    bench_min(&best, &run, rep);
+                }
+
+                for (s = 0; s < BENCH_STAGES; s++) {
+                    double ns_per_byte = best.bytes[s] ? best.seconds[s] * 1e9 / (double) best.bytes[s] : 0;
+                    double mb_per_s = best.seconds[s] > 0 ? (double) best.bytes[s] / best.seconds[s] / 1e6 : 0;
+
+                    if (json) {
+                        printf("{\"image\":\"%s\",\"tier\":\"%s\",\"color_type\":%d,\"bit_depth\":%d,\"layout\":\"%s\","
+                               "\"stage\":\"%s\",\"bytes\":%zu,\"seconds\":%.9f,\"ns_per_byte\":%.4f,\"mb_per_s\":%.2f}\n",
+                               strrchr(input, '/') + 1, bench_tiers[tier].name, bench_formats[format].color_type,
+                               bench_formats[format].bit_depth, layout ? "many" : "single", bench_stage_names[s],
+                               best.bytes[s], best.seconds[s], ns_per_byte, mb_per_s);
+                    } else {
+                        printf("%-28s %-9s %12zu %10.3f %10.1f\n", strrchr(input, '/') + 1, bench_stage_names[s],
+                               best.bytes[s], ns_per_byte, mb_per_s);
+                    }
+                }
+            }
+        }
+    }
+
+    unlink(output);
+    png_ctx_destroy(ctx);
+
+    return 0;
+}
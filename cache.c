@@ -0,0 +1,315 @@
+#include "png.h"
+
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+
+#define PNG_CACHE_MAGIC "PNGLRAW1"
+#define PNG_CACHE_HEADER 64
+
+#define PNG_XXH_P1 0x9E3779B185EBCA87ULL
+#define PNG_XXH_P2 0xC2B2AE3D27D4EB4FULL
+#define PNG_XXH_P3 0x165667B19E3779F9ULL
+#define PNG_XXH_P4 0x85EBCA77C2B2AE63ULL
+#define PNG_XXH_P5 0x27D4EB2F165667C5ULL
+
+struct __attribute__((packed)) png_cache_header {
+    char magic[8];
+    uint64_t hash;
+    uint64_t idat_len;
+    uint64_t image_len;
+    struct png_stats stats;
+};
+
+struct png_xxh64 {
+    uint64_t v[4];
+    unsigned char buffer[32];
+    size_t buffered;
+    uint64_t total;
+};
+
+struct png_cache_entry {
+    char name[64];
+    time_t mtime;
+    off_t size;
+};
+
+static inline uint64_t png_xxh_rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t png_xxh_read64(const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+static inline uint64_t png_xxh_round(uint64_t acc, uint64_t input) {
+    acc += input * PNG_XXH_P2;
+    acc = png_xxh_rotl(acc, 31);
+    return acc * PNG_XXH_P1;
+}
+
+static inline uint64_t png_xxh_merge(uint64_t acc, uint64_t v) {
+    acc ^= png_xxh_round(0, v);
+    return acc * PNG_XXH_P1 + PNG_XXH_P4;
+}
+
+static void png_xxh64_init(struct png_xxh64 *state) {
+    memset(state, 0, sizeof(*state));
+    state->v[0] = PNG_XXH_P1 + PNG_XXH_P2;
+    state->v[1] = PNG_XXH_P2;
+    state->v[2] = 0;
+    state->v[3] = -PNG_XXH_P1;
+}
+
+static void png_xxh64_update(struct png_xxh64 *state, const unsigned char *data, size_t len) {
+    const unsigned char *end = data + len;
+    size_t fill;
+
+    state->total += len;
+
+    if (state->buffered + len < 32) {
+        memcpy(state->buffer + state->buffered, data, len);
+        state->buffered += len;
+        return;
+    }
+
+    if (state->buffered) {
+        fill = 32 - state->buffered;
+        memcpy(state->buffer + state->buffered, data, fill);
+        data += fill;
+        state->v[0] = png_xxh_round(state->v[0], png_xxh_read64(state->buffer));
+        state->v[1] = png_xxh_round(state->v[1], png_xxh_read64(state->buffer + 8));
+        state->v[2] = png_xxh_round(state->v[2], png_xxh_read64(state->buffer + 16));
+        state->v[3] = png_xxh_round(state->v[3], png_xxh_read64(state->buffer + 24));
+        state->buffered = 0;
+    }
+
+    for (; data + 32 <= end; data += 32) {
+        state->v[0] = png_xxh_round(state->v[0], png_xxh_read64(data));
+        state->v[1] = png_xxh_round(state->v[1], png_xxh_read64(data + 8));
+        state->v[2] = png_xxh_round(state->v[2], png_xxh_read64(data + 16));
+        state->v[3] = png_xxh_round(state->v[3], png_xxh_read64(data + 24));
+    }
+
+    state->buffered = end - data;
+    memcpy(state->buffer, data, state->buffered);
+}
+
+static uint64_t png_xxh64_digest(const struct png_xxh64 *state) {
+    const unsigned char *p = state->buffer, *end = state->buffer + state->buffered;
+    uint64_t h, k;
+    uint32_t w;
+
+    if (state->total >= 32) {
+        h = png_xxh_rotl(state->v[0], 1) + png_xxh_rotl(state->v[1], 7) +
+            png_xxh_rotl(state->v[2], 12) + png_xxh_rotl(state->v[3], 18);
+        h = png_xxh_merge(h, state->v[0]);
+        h = png_xxh_merge(h, state->v[1]);
+        h = png_xxh_merge(h, state->v[2]);
+        h = png_xxh_merge(h, state->v[3]);
+    } else {
+        h = state->v[2] + PNG_XXH_P5;
+    }
+    h += state->total;
+
+    for (; p + 8 <= end; p += 8) {
+        k = png_xxh_round(0, png_xxh_read64(p));
+        h ^= k;
+        h = png_xxh_rotl(h, 27) * PNG_XXH_P1 + PNG_XXH_P4;
+    }
+    if (p + 4 <= end) {
+        memcpy(&w, p, 4);
+        h ^= (uint64_t) w * PNG_XXH_P1;
+        h = png_xxh_rotl(h, 23) * PNG_XXH_P2 + PNG_XXH_P3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        h ^= (*p) * PNG_XXH_P5;
+        h = png_xxh_rotl(h, 11) * PNG_XXH_P1;
+    }
+
+    h ^= h >> 33;
+    h *= PNG_XXH_P2;
+    h ^= h >> 29;
+    h *= PNG_XXH_P3;
+    h ^= h >> 32;
+
+    return h;
+}
+
+size_t png_cache_image_size(const struct png_stats *stats) {
+    struct png_adam7_pass passes[7];
+
+    if (!stats->interlace_method) {
+        return png_row_stride(stats) * stats->height;
+    }
+
+    png_adam7_passes(stats, passes);
+    return passes[6].image_offset + passes[6].stride * passes[6].height;
+}
+
+static void png_cache_path(char *path, size_t size, const char *dir, uint64_t hash) {
+    snprintf(path, size, "%s/%016llx.raw", dir, (unsigned long long) hash);
+}
+
+void png_cache_key(struct png_cache *cache, const struct png_index *index) {
+    struct png_xxh64 state;
+    size_t i;
+
+    png_xxh64_init(&state);
+    png_xxh64_update(&state, index->chunks[0].data, index->chunks[0].len);
+
+    cache->idat_len = 0;
+    for (i = index->idat_first; i < index->idat_last; i++) {
+        if (memcmp(index->chunks[i].type, "IDAT", 4) == 0) {
+            png_xxh64_update(&state, index->chunks[i].data, index->chunks[i].len);
+            cache->idat_len += index->chunks[i].len;
+        }
+    }
+
+    cache->hash = png_xxh64_digest(&state);
+}
+
+const unsigned char *png_cache_lookup(struct png_cache *cache, const struct png_stats *stats, const char *dir) {
+    struct png_cache_header header;
+    char path[4096];
+    struct stat st;
+    void *map;
+    size_t image_len = png_cache_image_size(stats);
+    int fd;
+
+    png_cache_path(path, sizeof(path), dir, cache->hash);
+    if ((fd = open(path, O_RDONLY | O_BINARY)) == -1) {
+        return NULL;
+    }
+
+    if (fstat(fd, &st) == -1 || (size_t) st.st_size != PNG_CACHE_HEADER + image_len ||
+        read(fd, &header, sizeof(header)) != (ssize_t) sizeof(header) ||
+        memcmp(header.magic, PNG_CACHE_MAGIC, 8) != 0 || header.hash != cache->hash ||
+        header.idat_len != cache->idat_len || header.image_len != image_len ||
+        memcmp(&header.stats, stats, sizeof(*stats)) != 0) {
+        close(fd);
+        return NULL;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (MAP_FAILED == map) {
+        close(fd);
+        return NULL;
+    }
+
+    futimes(fd, NULL);
+    close(fd);
+
+    cache->map = (unsigned char *) map;
+    cache->map_len = st.st_size;
+
+    return cache->map + PNG_CACHE_HEADER;
+}
+
+void png_cache_release(struct png_cache *cache) {
+    if (NULL != cache->map) {
+        munmap(cache->map, cache->map_len);
+        cache->map = NULL;
+        cache->map_len = 0;
+    }
+}
+
+static int png_cache_entry_cmp(const void *a, const void *b) {
+    const struct png_cache_entry *x = (const struct png_cache_entry *) a, *y = (const struct png_cache_entry *) b;
+    return (x->mtime > y->mtime) - (x->mtime < y->mtime);
+}
+
+static void png_cache_evict(const char *dir, size_t limit) {
+    struct png_cache_entry *entries = NULL, *temp;
+    size_t count = 0, capacity = 0, total = 0, i, len;
+    struct dirent *entry;
+    char path[4096];
+    struct stat st;
+    DIR *d;
+
+    if (NULL == (d = opendir(dir))) {
+        return;
+    }
+
+    while (NULL != (entry = readdir(d))) {
+        len = strlen(entry->d_name);
+        if (len != 20 || strcmp(entry->d_name + 16, ".raw") != 0) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+        if (stat(path, &st) == -1) {
+            continue;
+        }
+
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            if (NULL == (temp = (struct png_cache_entry *) realloc(entries, capacity * sizeof(*entries)))) {
+                break;
+            }
+            entries = temp;
+        }
+
+        memcpy(entries[count].name, entry->d_name, len + 1);
+        entries[count].mtime = st.st_mtime;
+        entries[count].size = st.st_size;
+        total += st.st_size;
+        count++;
+    }
+    closedir(d);
+
+    if (total > limit) {
+        qsort(entries, count, sizeof(*entries), png_cache_entry_cmp);
+        for (i = 0; i < count && total > limit; i++) {
+            snprintf(path, sizeof(path), "%s/%s", dir, entries[i].name);
+            unlink(path);
+            total -= entries[i].size;
+        }
+    }
+
+    free(entries);
+}
+
+void png_cache_store(const struct png_cache *cache, const struct png_stats *stats, const unsigned char *image,
+                     const char *dir, size_t limit) {
+
+    struct png_cache_header header;
+    unsigned char block[PNG_CACHE_HEADER];
+    char path[4096], tmp[4096];
+    size_t image_len = png_cache_image_size(stats);
+    _Bool ok;
+    int fd;
+
+    if (PNG_CACHE_HEADER + image_len > limit) {
+        return;
+    }
+
+    snprintf(tmp, sizeof(tmp), "%s/.%016llx.%ld.%p.tmp", dir, (unsigned long long) cache->hash, (long) getpid(),
+             (const void *) cache);
+    if ((fd = open(tmp, O_CREAT | O_EXCL | O_WRONLY | O_BINARY, S_IREAD | S_IWRITE)) == -1) {
+        return;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, PNG_CACHE_MAGIC, 8);
+    header.hash = cache->hash;
+    header.idat_len = cache->idat_len;
+    header.image_len = image_len;
+    header.stats = *stats;
+
+    memset(block, 0, sizeof(block));
+    memcpy(block, &header, sizeof(header));
+
+    ok = png_write_all(fd, block, sizeof(block)) && png_write_all(fd, image, image_len);
+    close(fd);
+
+    png_cache_path(path, sizeof(path), dir, cache->hash);
+    if (!ok || rename(tmp, path) == -1) {
+        unlink(tmp);
+        return;
+    }
+
+    png_cache_evict(dir, limit);
+}
@@ -0,0 +1,319 @@
+#include "png.h"
+
+#include <pthread.h>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+    #include <cpuid.h>
+    #include <immintrin.h>
+    #define PNG_CRC_PCLMUL
+#elif defined(__aarch64__) && defined(__linux__) && (defined(__GNUC__) || defined(__clang__))
+    #include <arm_acle.h>
+    #include <sys/auxv.h>
+    #include <asm/hwcap.h>
+    #define PNG_CRC_ARMV8
+#endif
+
+#define CRC_POLY 0xedb88320
+
+static uint32_t crc_slice[8][256];
+static uint32_t crc_x2n[32];
+
+static uint32_t (*crc_engine)(uint32_t c, const unsigned char *data, size_t len);
+static const char *crc_engine_name;
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static uint32_t crc_bytewise(uint32_t c, const unsigned char *data, size_t len) {
+    while (len--) {
+        c = crc_slice[0][(c ^ *data++) & 255] ^ (c >> 8);
+    }
+    return c;
+}
+
+static uint32_t crc_slice8(uint32_t c, const unsigned char *data, size_t len) {
+    uint32_t lo, hi;
+
+    while (len && ((uintptr_t) data & 7)) {
+        c = crc_slice[0][(c ^ *data++) & 255] ^ (c >> 8);
+        len--;
+    }
+
+    while (len >= 8) {
+        lo = c ^ ((uint32_t) data[0] | (uint32_t) data[1] << 8 | (uint32_t) data[2] << 16 | (uint32_t) data[3] << 24);
+        hi = (uint32_t) data[4] | (uint32_t) data[5] << 8 | (uint32_t) data[6] << 16 | (uint32_t) data[7] << 24;
+        c = crc_slice[7][lo & 255] ^ crc_slice[6][(lo >> 8) & 255] ^
+            crc_slice[5][(lo >> 16) & 255] ^ crc_slice[4][lo >> 24] ^
+            crc_slice[3][hi & 255] ^ crc_slice[2][(hi >> 8) & 255] ^
+            crc_slice[1][(hi >> 16) & 255] ^ crc_slice[0][hi >> 24];
+        data += 8;
+        len -= 8;
+    }
+
+    return crc_bytewise(c, data, len);
+}
+
+#ifdef PNG_CRC_PCLMUL
+__attribute__((target("pclmul,sse2")))
+static uint32_t crc_fold_pclmul(uint32_t c, const unsigned char *data, size_t len) {
+    const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+    const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+    const __m128i k5k0 = _mm_set_epi64x(0, 0x0163cd6124);
+    const __m128i poly = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+    const __m128i mask = _mm_setr_epi32(~0, 0, ~0, 0);
+    __m128i x1, x2, x3, x4, x5, x6, x7, x8;
+    size_t blocks;
+
+    if (len < 64) {
+        return crc_slice8(c, data, len);
+    }
+
+    blocks = len & ~(size_t) 15;
+
+    x1 = _mm_xor_si128(_mm_loadu_si128((const __m128i *) data), _mm_cvtsi32_si128((int) c));
+    x2 = _mm_loadu_si128((const __m128i *) (data + 16));
+    x3 = _mm_loadu_si128((const __m128i *) (data + 32));
+    x4 = _mm_loadu_si128((const __m128i *) (data + 48));
+    data += 64;
+    len -= 64;
+    blocks -= 64;
+
+    while (blocks >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+
+        x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i *) data));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i *) (data + 16)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i *) (data + 32)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i *) (data + 48)));
+
+        data += 64;
+        len -= 64;
+        blocks -= 64;
+    }
+
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    while (blocks >= 16) {
+        x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128((const __m128i *) data)), x5);
+
+        data += 16;
+        len -= 16;
+        blocks -= 16;
+    }
+
+    x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, mask);
+    x1 = _mm_clmulepi64_si128(x1, k5k0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    x2 = _mm_and_si128(x1, mask);
+    x2 = _mm_clmulepi64_si128(x2, poly, 0x10);
+    x2 = _mm_and_si128(x2, mask);
+    x2 = _mm_clmulepi64_si128(x2, poly, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    c = (uint32_t) _mm_cvtsi128_si32(_mm_srli_si128(x1, 4));
+
+    return crc_slice8(c, data, len);
+}
+#endif
+
+#ifdef PNG_CRC_ARMV8
+__attribute__((target("+crc")))
+static uint32_t crc_armv8(uint32_t c, const unsigned char *data, size_t len) {
+    uint64_t word;
+
+    while (len && ((uintptr_t) data & 7)) {
+        c = __crc32b(c, *data++);
+        len--;
+    }
+
+    while (len >= 8) {
+        memcpy(&word, data, 8);
+        c = __crc32d(c, word);
+        data += 8;
+        len -= 8;
+    }
+
+    while (len--) {
+        c = __crc32b(c, *data++);
+    }
+
+    return c;
+}
+#endif
+
+static uint32_t crc_multmodp(uint32_t a, uint32_t b) {
+    uint32_t m = (uint32_t) 1 << 31, p = 0;
+
+    for (;;) {
+        if (a & m) {
+            p ^= b;
+            if ((a & (m - 1)) == 0) {
+                break;
+            }
+        }
+        m >>= 1;
+        b = b & 1 ? (b >> 1) ^ CRC_POLY : b >> 1;
+    }
+
+    return p;
+}
+
+static void crc_init(void) {
+    uint32_t c, p;
+    int i, j;
+
+    for (i = 0; i < 256; i++) {
+        c = i;
+        for (j = 0; j < 8; j++) {
+            c = c & 1 ? CRC_POLY ^ (c >> 1) : c >> 1;
+        }
+        crc_slice[0][i] = c;
+    }
+
+    for (i = 0; i < 256; i++) {
+        c = crc_slice[0][i];
+        for (j = 1; j < 8; j++) {
+            c = crc_slice[0][c & 255] ^ (c >> 8);
+            crc_slice[j][i] = c;
+        }
+    }
+
+    p = (uint32_t) 1 << 30;
+    crc_x2n[0] = p;
+    for (i = 1; i < 32; i++) {
+        crc_x2n[i] = p = crc_multmodp(p, p);
+    }
+
+    crc_engine = crc_slice8;
+    crc_engine_name = "slice8";
+
+#ifdef PNG_CRC_PCLMUL
+    unsigned int eax, ebx, ecx, edx;
+    if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_PCLMUL) && (edx & bit_SSE2)) {
+        crc_engine = crc_fold_pclmul;
+        crc_engine_name = "pclmul";
+    }
+#endif
+
+#ifdef PNG_CRC_ARMV8
+    if (getauxval(AT_HWCAP) & HWCAP_CRC32) {
+        crc_engine = crc_armv8;
+        crc_engine_name = "armv8-crc";
+    }
+#endif
+}
+
+uint32_t png_crc32(uint32_t crc, const unsigned char *data, size_t len) {
+    pthread_once(&crc_once, crc_init);
+    return ~crc_engine(~crc, data, len);
+}
+
+uint32_t png_crc32_combine(uint32_t crc1, uint32_t crc2, size_t len2) {
+    uint32_t p = (uint32_t) 1 << 31;
+    unsigned int k = 3;
+
+    pthread_once(&crc_once, crc_init);
+
+    while (len2) {
+        if (len2 & 1) {
+            p = crc_multmodp(crc_x2n[k & 31], p);
+        }
+        len2 >>= 1;
+        k++;
+    }
+
+    return crc_multmodp(p, crc1) ^ crc2;
+}
+
+const char *png_crc32_engine(void) {
+    pthread_once(&crc_once, crc_init);
+    return crc_engine_name;
+}
+
+_Bool png_crc32_selftest(const uint32_t *tbl) {
+    static const struct {
+        const char *name;
+        uint32_t (*fn)(uint32_t, const unsigned char *, size_t);
+    } engines[] = {
+            {"bytewise", crc_bytewise},
+            {"slice8",   crc_slice8},
+#ifdef PNG_CRC_PCLMUL
+            {"pclmul",   crc_fold_pclmul},
+#endif
+#ifdef PNG_CRC_ARMV8
+            {"armv8-crc", crc_armv8},
+#endif
+    };
+
+    unsigned char buffer[4096 + 16];
+    uint32_t expected, got, seed = 0x2545f491;
+    size_t i, e, len, off, split;
+    _Bool ok = 1;
+
+    pthread_once(&crc_once, crc_init);
+
+    for (i = 0; i < sizeof(buffer); i++) {
+        seed = seed * 1103515245 + 12345;
+        buffer[i] = seed >> 16;
+    }
+
+    for (e = 0; e < sizeof(engines) / sizeof(*engines); e++) {
+#ifdef PNG_CRC_PCLMUL
+        if (engines[e].fn == crc_fold_pclmul && crc_engine != crc_fold_pclmul) {
+            continue;
+        }
+#endif
+#ifdef PNG_CRC_ARMV8
+        if (engines[e].fn == crc_armv8 && crc_engine != crc_armv8) {
+            continue;
+        }
+#endif
+        for (len = 0; len <= 4096; len += len < 300 ? 1 : 61) {
+            for (off = 0; off < 16; off += 5) {
+                expected = crc(buffer, off, len, tbl);
+                got = ~engines[e].fn(~0u, buffer + off, len);
+                if (expected != got) {
+                    fprintf(stderr, "crc32 %s: mismatch at offset %zu, length %zu (%08x != %08x)\n",
+                            engines[e].name, off, len, got, expected);
+                    ok = 0;
+                    break;
+                }
+            }
+        }
+    }
+
+    for (split = 0; split <= 4096; split += 97) {
+        expected = crc(buffer, 0, 4096, tbl);
+        got = png_crc32_combine(png_crc32(0, buffer, split), png_crc32(0, buffer + split, 4096 - split), 4096 - split);
+        if (expected != got) {
+            fprintf(stderr, "crc32 combine: mismatch at split %zu (%08x != %08x)\n", split, got, expected);
+            ok = 0;
+            break;
+        }
+    }
+
+    return ok;
+}
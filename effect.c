@@ -0,0 +1,192 @@
+#include "png.h"
+
+#define PNG_EFFECTS_BLOCK 4096
+
+static const unsigned char png_effects_bpps[7] = {1, 2, 3, 4, 6, 8, 16};
+
+static uint64_t png_effects_next(uint64_t *state) {
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+static uint64_t png_effects_key(const struct png_effects *fx, uint64_t lane, uint64_t n) {
+    uint64_t state = fx->seed ^ fx->salt * 0xD6E8FEB86659FD93ull ^ lane * 0xA0761D6478BD642Full ^ n * 0xE7037ED1A0B428DBull;
+    png_effects_next(&state);
+    return state;
+}
+
+static _Bool png_effects_hit(uint64_t roll, uint64_t chance) {
+    return (roll >> 32) < chance;
+}
+
+static _Bool png_effects_chance(const char *value, double scale, uint64_t *chance) {
+    char *end;
+    double p = strtod(value, &end);
+
+    if (end == value || p < 0 || p > 1) {
+        return 0;
+    }
+    *chance = (uint64_t) (p * scale * 4294967296.0);
+    return ':' == *end || '\0' == *end;
+}
+
+int png_effects_parse(struct png_effects *fx, const char *spec, const struct png_stats *stats) {
+    char buffer[256], *item, *value, *save = NULL;
+    uint64_t *chance;
+    unsigned long max;
+
+    memset(fx, 0, sizeof(*fx));
+    if (NULL == spec || '\0' == *spec) {
+        return PNG_OK;
+    }
+    if (strlen(spec) >= sizeof(buffer)) {
+        return PNG_ERR_ARG;
+    }
+    strcpy(buffer, spec);
+
+    for (item = strtok_r(buffer, ",", &save); NULL != item; item = strtok_r(NULL, ",", &save)) {
+        if (NULL == (value = strchr(item, '='))) {
+            return PNG_ERR_ARG;
+        }
+        *value++ = '\0';
+
+        if (!strcmp(item, "seed")) {
+            fx->seed = strtoull(value, NULL, 0);
+            continue;
+        }
+        if (!strcmp(item, "corrupt")) {
+            if (!png_effects_chance(value, PNG_EFFECTS_BLOCK, &fx->corrupt)) {
+                return PNG_ERR_ARG;
+            }
+            continue;
+        }
+
+        if (!strcmp(item, "swap")) {
+            chance = &fx->swap;
+        } else if (!strcmp(item, "bpp")) {
+            chance = &fx->bpp;
+        } else if (!strcmp(item, "shift")) {
+            chance = &fx->shift;
+        } else if (!strcmp(item, "drift")) {
+            chance = &fx->drift;
+        } else if (!strcmp(item, "rotate")) {
+            chance = &fx->rotate;
+        } else {
+            return PNG_ERR_ARG;
+        }
+        if (!png_effects_chance(value, 1, chance)) {
+            return PNG_ERR_ARG;
+        }
+
+        if (NULL != (value = strchr(value, ':'))) {
+            max = strtoul(value + 1, NULL, 10);
+            if (chance == &fx->shift) {
+                fx->shift_max = max;
+            } else if (chance == &fx->drift) {
+                fx->drift_max = (unsigned int) max;
+            } else {
+                return PNG_ERR_ARG;
+            }
+        }
+    }
+
+    if (stats->bit_depth >= 8) {
+        fx->sample = stats->bit_depth / 8;
+        fx->channels = (unsigned char) (png_pixel_bits(stats) / stats->bit_depth);
+    }
+    if (fx->drift_max == 0 || fx->drift_max > 255) {
+        fx->drift_max = 16;
+    }
+    fx->active = fx->swap || fx->bpp || fx->shift || fx->drift || fx->rotate;
+
+    return PNG_OK;
+}
+
+static void png_effects_rotate(unsigned char *row, size_t stride, unsigned char channels, unsigned char sample,
+                               size_t by) {
+    size_t pixel = (size_t) channels * sample, head = by * sample, x;
+    unsigned char temp[8];
+
+    for (x = 0; x + pixel <= stride; x += pixel) {
+        memcpy(temp, row + x, pixel);
+        memcpy(row + x, temp + head, pixel - head);
+        memcpy(row + x + pixel - head, temp, head);
+    }
+}
+
+void png_effects_row(const struct png_effects *fx, uint64_t y, unsigned char *restrict filtered,
+                     const unsigned char *row, const unsigned char *prev, size_t stride, unsigned char bpp,
+                     unsigned char filter_method, unsigned char *scratch) {
+
+    uint64_t state = png_effects_key(fx, 0, y), roll[10];
+    const unsigned char *src = row;
+    unsigned char delta;
+    size_t i, k;
+
+    for (i = 0; i < 10; i++) {
+        roll[i] = png_effects_next(&state);
+    }
+
+    if (png_effects_hit(roll[0], fx->shift) && stride > 1) {
+        k = 1 + (size_t) (roll[1] % (fx->shift_max && fx->shift_max < stride ? fx->shift_max : stride - 1));
+        memcpy(scratch, row + k, stride - k);
+        memcpy(scratch + stride - k, row, k);
+        src = scratch;
+    }
+    if (png_effects_hit(roll[2], fx->rotate) && fx->channels > 1) {
+        if (src != scratch) {
+            memcpy(scratch, row, stride);
+            src = scratch;
+        }
+        png_effects_rotate(scratch, stride, fx->channels, fx->sample, 1 + (size_t) (roll[3] % (fx->channels - 1)));
+    }
+    if (png_effects_hit(roll[4], fx->bpp)) {
+        bpp = png_effects_bpps[roll[5] % sizeof(png_effects_bpps)];
+    }
+
+    if (filter_method > PNG_FILTER_PAETH) {
+        png_filter_row_adaptive(filtered, src, prev, stride, bpp, filter_method, scratch + stride);
+    } else {
+        png_filter_row(filtered, src, prev, stride, bpp, filter_method);
+    }
+
+    if (png_effects_hit(roll[6], fx->swap)) {
+        filtered[0] = (unsigned char) ((filtered[0] + 1 + roll[7] % 4) % 5);
+    }
+    if (png_effects_hit(roll[8], fx->drift)) {
+        delta = (unsigned char) (1 + roll[9] % fx->drift_max);
+        if (roll[9] >> 63) {
+            delta = (unsigned char) -delta;
+        }
+        for (i = 1; i <= stride; i++) {
+            filtered[i] += delta;
+        }
+    }
+}
+
+void png_effects_corrupt(const struct png_effects *fx, unsigned char *data, size_t len, size_t offset) {
+    size_t block, end = offset + len, pos;
+    uint64_t state, roll, hits;
+
+    if (0 == fx->corrupt || 0 == len) {
+        return;
+    }
+
+    for (block = offset / PNG_EFFECTS_BLOCK; block * PNG_EFFECTS_BLOCK < end; block++) {
+        state = png_effects_key(fx, 1, block);
+        hits = fx->corrupt >> 32;
+        if (png_effects_hit(png_effects_next(&state), fx->corrupt & 0xFFFFFFFFu)) {
+            hits++;
+        }
+
+        while (hits--) {
+            roll = png_effects_next(&state);
+            pos = block * PNG_EFFECTS_BLOCK + (size_t) (roll % PNG_EFFECTS_BLOCK);
+            if (pos >= 2 && pos >= offset && pos < end) {
+                data[pos - offset] ^= (unsigned char) (1 + (roll >> 32) % 255);
+            }
+        }
+    }
+}
@@ -0,0 +1,185 @@
+#include "png.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <sys/mman.h>
+
+#ifndef IOV_MAX
+    #define IOV_MAX 1024
+#endif
+
+static _Bool png_emit_push(struct png_emitter *emitter, const void *base, size_t len) {
+    struct iovec *temp;
+    size_t capacity;
+
+    if (len == 0) {
+        return 1;
+    }
+
+    if (emitter->count == emitter->capacity) {
+        capacity = emitter->capacity ? emitter->capacity * 2 : 64;
+        temp = (struct iovec *) png_realloc(emitter->iov, capacity * sizeof(*emitter->iov));
+        if (NULL == temp) {
+            return 0;
+        }
+        emitter->iov = temp;
+        emitter->capacity = capacity;
+    }
+
+    emitter->iov[emitter->count].iov_base = (void *) base;
+    emitter->iov[emitter->count].iov_len = len;
+    emitter->count++;
+    emitter->total += len;
+
+    return 1;
+}
+
+static _Bool png_emit_slices(struct png_emitter *emitter, const struct png_index *index, size_t from, size_t to) {
+    if (from >= to) {
+        return 1;
+    }
+    return png_emit_push(emitter, index->base + index->chunks[from].offset,
+                         index->chunks[to - 1].offset + index->chunks[to - 1].len + 12 - index->chunks[from].offset);
+}
+
+int png_emit_build(struct png_emitter *emitter, const struct png_index *index, const unsigned char *ihdr,
+                   const unsigned char *compressed, size_t compressed_len, uint32_t max_len) {
+
+    size_t pieces = compressed_len ? (compressed_len + max_len - 1) / max_len : 1;
+    size_t i, offset = 0;
+    uint32_t len, be, checksum;
+    unsigned char *frame;
+
+    emitter->count = 0;
+    emitter->total = 0;
+
+    if (pieces * 12 > emitter->frames_capacity) {
+        free(emitter->frames);
+        emitter->frames_capacity = 0;
+        if (NULL == (emitter->frames = (unsigned char *) png_malloc(pieces * 12))) {
+            return PNG_ERR_NOMEM;
+        }
+        emitter->frames_capacity = pieces * 12;
+    }
+
+    if (!png_emit_push(emitter, index->base, 8) || (NULL != ihdr && !png_emit_push(emitter, ihdr, 25)) ||
+        !png_emit_slices(emitter, index, NULL != ihdr, index->idat_first)) {
+        return PNG_ERR_NOMEM;
+    }
+
+    for (i = 0; i < pieces; i++) {
+        len = compressed_len - offset < max_len ? (uint32_t) (compressed_len - offset) : max_len;
+        frame = emitter->frames + i * 12;
+
+        be = byteswap_ulong(len);
+        memcpy(frame, &be, 4);
+        memcpy(frame + 4, "IDAT", 4);
+
+        checksum = byteswap_ulong(png_crc32(png_crc32(0, frame + 4, 4), compressed + offset, len));
+        memcpy(frame + 8, &checksum, 4);
+
+        if (!png_emit_push(emitter, frame, 8) || !png_emit_push(emitter, compressed + offset, len) ||
+            !png_emit_push(emitter, frame + 8, 4)) {
+            return PNG_ERR_NOMEM;
+        }
+
+        offset += len;
+    }
+
+    return png_emit_slices(emitter, index, index->idat_last, index->count) ? PNG_OK : PNG_ERR_NOMEM;
+}
+
+int png_emit_flatten(const struct png_emitter *emitter, struct png_buffer *out) {
+    unsigned char *tmp;
+    size_t i;
+
+    if (!png_buffer_reserve(out, emitter->total)) {
+        return PNG_ERR_NOMEM;
+    }
+
+    tmp = out->data;
+    for (i = 0; i < emitter->count; i++) {
+        memcpy(tmp, emitter->iov[i].iov_base, emitter->iov[i].iov_len);
+        tmp += emitter->iov[i].iov_len;
+    }
+    out->len = emitter->total;
+
+    return PNG_OK;
+}
+
+void png_emit_free(struct png_emitter *emitter) {
+    free(emitter->iov);
+    free(emitter->frames);
+    memset(emitter, 0, sizeof(*emitter));
+}
+
+static _Bool png_emit_writev(int fd, struct iovec *iov, size_t count) {
+    ssize_t written;
+    int batch;
+
+    while (count > 0) {
+        batch = count > IOV_MAX ? IOV_MAX : (int) count;
+        if ((written = writev(fd, iov, batch)) < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return 0;
+        }
+
+        while (count > 0 && (size_t) written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (written > 0) {
+            iov->iov_base = (unsigned char *) iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+
+    return 1;
+}
+
+static _Bool png_emit_mmap(int fd, const struct png_emitter *emitter) {
+    unsigned char *map, *tmp;
+    size_t i;
+
+    if (ftruncate(fd, (off_t) emitter->total) == -1) {
+        return 0;
+    }
+
+    map = (unsigned char *) mmap(NULL, emitter->total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (MAP_FAILED == map) {
+        return 0;
+    }
+
+    tmp = map;
+    for (i = 0; i < emitter->count; i++) {
+        memcpy(tmp, emitter->iov[i].iov_base, emitter->iov[i].iov_len);
+        tmp += emitter->iov[i].iov_len;
+    }
+
+    return munmap(map, emitter->total) == 0;
+}
+
+_Bool png_emit_write(int fd, struct png_emitter *emitter, _Bool use_mmap) {
+    return use_mmap ? png_emit_mmap(fd, emitter) : png_emit_writev(fd, emitter->iov, emitter->count);
+}
+
+int png_emit_image(struct png_ctx *ctx, const char *output, const struct png_index *index, const unsigned char *ihdr,
+                   const unsigned char *compressed, size_t compressed_len, uint32_t max_len, _Bool use_mmap) {
+
+    struct png_output out;
+    int err;
+
+    if (PNG_OK != (err = png_emit_build(&ctx->emitter, index, ihdr, compressed, compressed_len, max_len)) ||
+        PNG_OK != (err = png_output_begin(&out, output))) {
+        return err;
+    }
+
+    if (!png_emit_write(out.fd, &ctx->emitter, use_mmap && out.fd != STDOUT_FILENO)) {
+        err = PNG_ERR_IO;
+    }
+
+    return png_output_end(&out, err);
+}
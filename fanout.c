@@ -0,0 +1,261 @@
+#include "png.h"
+
+#include <pthread.h>
+
+struct png_fanout {
+    struct png_ctx *source;
+    const struct png_stats *stats;
+    const unsigned char *image;
+    size_t image_len;
+    const unsigned char *ihdr;
+    char (*paths)[4096];
+    const struct png_variant *variants;
+    size_t count;
+    png_compress_fn compress;
+
+    pthread_mutex_t lock;
+    size_t next;
+    int err;
+};
+
+static _Bool png_fanout_path(char *path, size_t size, const char *template, const struct png_variant *variant,
+                             const struct png_stats *stats, size_t n) {
+    size_t len = 0;
+    int written;
+
+    while (*template && len < size) {
+        if (!strncmp(template, "{filter}", 8)) {
+            written = snprintf(path + len, size - len, "%s", png_filter_name(variant->filter_method));
+            template += 8;
+        } else if (!strncmp(template, "{bpp}", 5)) {
+            written = snprintf(path + len, size - len, "%u", variant->bpp ? variant->bpp : stats->bit_depth);
+            template += 5;
+        } else if (!strncmp(template, "{level}", 7)) {
+            written = snprintf(path + len, size - len, "%d", variant->level < 0 ? 6 : variant->level);
+            template += 7;
+        } else if (!strncmp(template, "{n}", 3)) {
+            written = snprintf(path + len, size - len, "%zu", n);
+            template += 3;
+        } else {
+            path[len] = *template++;
+            written = 1;
+        }
+        len += written;
+    }
+
+    if (len >= size) {
+        return 0;
+    }
+    path[len] = '\0';
+
+    return 1;
+}
+
+/* every variant needs its own file, or the workers would race on one path */
+static int png_fanout_paths(struct png_ctx *ctx, struct png_fanout *fanout, const char *template) {
+    size_t i, j;
+
+    if (NULL == (fanout->paths = png_arena_alloc(&ctx->arena, fanout->count * sizeof(*fanout->paths)))) {
+        return PNG_ERR_NOMEM;
+    }
+
+    for (i = 0; i < fanout->count; i++) {
+        if (!png_fanout_path(fanout->paths[i], sizeof(fanout->paths[i]), template, &fanout->variants[i], fanout->stats, i)) {
+            return PNG_ERR_ARG;
+        }
+        for (j = 0; j < i; j++) {
+            if (!strcmp(fanout->paths[i], fanout->paths[j])) {
+                return PNG_ERR_ARG;
+            }
+        }
+    }
+
+    return PNG_OK;
+}
+
+static int png_fanout_job(struct png_ctx *ctx, const struct png_fanout *fanout, size_t n) {
+    const struct png_variant *variant = &fanout->variants[n];
+    struct png_stats stats = *fanout->stats;
+    int err;
+
+    if (variant->bpp) {
+        stats.bit_depth = variant->bpp;
+    }
+
+    if (variant->filter_method > PNG_FILTER_PAETH) {
+        err = png_filter_image_adaptive(ctx, fanout->image, fanout->image_len, &stats, variant->filter_method, &ctx->filtered);
+    } else {
+        err = png_filter_image_fixed(ctx, fanout->image, fanout->image_len, &stats, variant->filter_method, &ctx->filtered);
+    }
+    if (PNG_OK != err) {
+        return err;
+    }
+
+    deflateReset(&ctx->deflate_strm);
+    if (Z_OK != deflateParams(&ctx->deflate_strm, variant->level < 0 ? Z_DEFAULT_COMPRESSION : variant->level, Z_DEFAULT_STRATEGY)) {
+        return PNG_ERR_ZLIB;
+    }
+    if (PNG_OK != (err = fanout->compress(ctx, ctx->filtered.data, ctx->filtered.len, &ctx->compressed))) {
+        return err;
+    }
+    png_effects_corrupt(&ctx->effects, ctx->compressed.data, ctx->compressed.len, 0);
+
+    return png_emit_image(ctx, fanout->paths[n], &fanout->source->index, fanout->ihdr, ctx->compressed.data, ctx->compressed.len,
+                          1 << 16, 0);
+}
+
+static void *png_fanout_worker(void *arg) {
+    struct png_fanout *fanout = (struct png_fanout *) arg;
+    struct png_ctx *ctx = png_ctx_create();
+    size_t n;
+    int err;
+
+    if (NULL != ctx) {
+        ctx->effects = fanout->source->effects;
+    }
+
+    for (;;) {
+        pthread_mutex_lock(&fanout->lock);
+        n = fanout->next++;
+        pthread_mutex_unlock(&fanout->lock);
+
+        if (n >= fanout->count) {
+            break;
+        }
+
+        err = NULL == ctx ? PNG_ERR_NOMEM : png_fanout_job(ctx, fanout, n);
+        if (PNG_OK != err) {
+            pthread_mutex_lock(&fanout->lock);
+            if (PNG_OK == fanout->err) {
+                fanout->err = err;
+            }
+            pthread_mutex_unlock(&fanout->lock);
+        }
+    }
+
+    png_ctx_destroy(ctx);
+    return NULL;
+}
+
+static int png_fanout_decode(struct png_ctx *ctx, const struct png_stats *stats, const struct png_opts *opts,
+                             const unsigned char **image) {
+    const unsigned char *cached;
+    size_t raw = png_row_stride(stats) * stats->height;
+    int err;
+
+    if (PNG_OK != (err = png_glitch_inflate(ctx, stats, opts, &cached))) {
+        return err;
+    }
+
+    if (stats->interlace_method) {
+        if (PNG_OK != (err = png_adam7_deinterlace(ctx, stats, cached))) {
+            return err;
+        }
+        *image = ctx->deinterlaced.data;
+    } else if (NULL != cached) {
+        *image = cached;
+        return PNG_OK;
+    } else {
+        if (ctx->inflated.len < raw + stats->height) {
+            return PNG_ERR_TRUNCATED;
+        }
+        PNG_TRACE_BEGIN(PNG_STAGE_UNFILTER, ctx->inflated.len)
+        err = png_reconstruct_image(ctx, ctx->inflated.data, raw, stats, &ctx->image);
+        PNG_TRACE_END(PNG_STAGE_UNFILTER, raw)
+        if (PNG_OK != err) {
+            return err;
+        }
+        *image = ctx->image.data;
+    }
+
+    if (NULL == cached) {
+        png_glitch_remember(ctx, stats, opts);
+    }
+
+    return PNG_OK;
+}
+
+int png_glitch_fanout(struct png_ctx *ctx, const char *input, const char *output_template,
+                      const struct png_variant *variants, size_t count, unsigned int threads, const struct png_opts *opts) {
+
+    struct png_opts progressive;
+    struct png_fanout fanout;
+    struct png_stats stats;
+    pthread_t *workers;
+    size_t i, started;
+    int err;
+
+    if (NULL == ctx || NULL == input || NULL == output_template || NULL == variants || NULL == opts || count == 0) {
+        return PNG_ERR_ARG;
+    }
+    for (i = 0; i < count; i++) {
+        if (variants[i].filter_method > PNG_FILTER_ENTROPY || variants[i].level > 9) {
+            return PNG_ERR_ARG;
+        }
+    }
+    if (!strcmp(output_template, "-") && count > 1) {
+        return PNG_ERR_ARG;
+    }
+
+    png_arena_reset(&ctx->arena);
+    if (PNG_OK != (err = png_glitch_open(ctx, input))) {
+        return err;
+    }
+
+    memset(&fanout, 0, sizeof(fanout));
+    if (PNG_OK != (err = png_raw_attach(ctx, opts->raw_format)) ||
+        PNG_OK != (err = png_glitch_parse(ctx, &stats)) ||
+        PNG_OK != (err = png_effects_parse(&ctx->effects, opts->effects, &stats)) ||
+        PNG_OK != (err = png_fanout_decode(ctx, &stats, opts, &fanout.image))) {
+        png_cache_release(&ctx->cache);
+        png_raw_close(ctx);
+        png_index_close(&ctx->index);
+        return err;
+    }
+
+    progressive = *opts;
+    progressive.progressive = 1;
+
+    fanout.source = ctx;
+    fanout.stats = &stats;
+    fanout.image_len = png_row_stride(&stats) * stats.height;
+    fanout.ihdr = png_glitch_ihdr(ctx, &stats, &progressive);
+    fanout.variants = variants;
+    fanout.count = count;
+    fanout.compress = opts->preview ? png_preview_compress : png_zlib_compress;
+    if (PNG_OK != (err = png_fanout_paths(ctx, &fanout, output_template))) {
+        png_cache_release(&ctx->cache);
+        png_raw_close(ctx);
+        png_index_close(&ctx->index);
+        return err;
+    }
+    pthread_mutex_init(&fanout.lock, NULL);
+
+    if (threads == 0) {
+        threads = 1;
+    }
+    if (threads > count) {
+        threads = count;
+    }
+
+    workers = (pthread_t *) png_arena_alloc(&ctx->arena, threads * sizeof(*workers));
+    started = 1;
+    if (NULL != workers) {
+        for (; started < threads; started++) {
+            if (pthread_create(&workers[started], NULL, png_fanout_worker, &fanout) != 0) {
+                break;
+            }
+        }
+    }
+    png_fanout_worker(&fanout);
+    for (i = 1; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+
+    pthread_mutex_destroy(&fanout.lock);
+    png_cache_release(&ctx->cache);
+    png_raw_close(ctx);
+    png_index_close(&ctx->index);
+
+    return fanout.err;
+}
@@ -0,0 +1,785 @@
+#include "png.h"
+
+#include <math.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+    #include <immintrin.h>
+    #define PNG_FILTER_X86
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    #include <arm_neon.h>
+    #define PNG_FILTER_NEON
+#endif
+
+#define PNG_BPP_CLASSES 6
+
+static png_unfilter_fn unfilter_tbl[5][PNG_BPP_CLASSES];
+static png_filter_fn filter_tbl[5][PNG_BPP_CLASSES];
+static size_t (*filter_score)(const unsigned char *row, size_t len);
+static const char *filter_isa;
+static pthread_once_t filter_once = PTHREAD_ONCE_INIT;
+
+static int png_bpp_class(unsigned char bpp) {
+    switch (bpp) {
+        case 1:
+            return 0;
+        case 2:
+            return 1;
+        case 4:
+            return 2;
+        case 8:
+            return 3;
+        case 16:
+            return 4;
+        default:
+            return 5;
+    }
+}
+
+static void unfilter_none(unsigned char *restrict row, const unsigned char *restrict prev, size_t stride, unsigned char bpp) {
+}
+
+static void unfilter_sub(unsigned char *restrict row, const unsigned char *restrict prev, size_t stride, unsigned char bpp) {
+    size_t c;
+    for (c = bpp; c < stride; c++) {
+        row[c] += row[c - bpp];
+    }
+}
+
+static void unfilter_up(unsigned char *restrict row, const unsigned char *restrict prev, size_t stride, unsigned char bpp) {
+    size_t c;
+    for (c = 0; c < stride; c++) {
+        row[c] += prev[c];
+    }
+}
+
+static void unfilter_avg(unsigned char *restrict row, const unsigned char *restrict prev, size_t stride, unsigned char bpp) {
+    size_t c, head = bpp < stride ? bpp : stride;
+    for (c = 0; c < head; c++) {
+        row[c] += prev[c] / 2;
+    }
+    for (; c < stride; c++) {
+        row[c] += (row[c - bpp] + prev[c]) / 2;
+    }
+}
+
+static void unfilter_paeth(unsigned char *restrict row, const unsigned char *restrict prev, size_t stride, unsigned char bpp) {
+    size_t c, head = bpp < stride ? bpp : stride;
+    for (c = 0; c < head; c++) {
+        row[c] += paeth(0, prev[c], 0);
+    }
+    for (; c < stride; c++) {
+        row[c] += paeth(row[c - bpp], prev[c], prev[c - bpp]);
+    }
+}
+
+static void filter_none(unsigned char *restrict out, const unsigned char *restrict row, const unsigned char *restrict prev, size_t stride, unsigned char bpp) {
+    memcpy(out, row, stride);
+}
+
+static void filter_sub(unsigned char *restrict out, const unsigned char *restrict row, const unsigned char *restrict prev, size_t stride, unsigned char bpp) {
+    size_t c, head = bpp < stride ? bpp : stride;
+    memcpy(out, row, head);
+    for (c = head; c < stride; c++) {
+        out[c] = row[c] - row[c - bpp];
+    }
+}
+
+static void filter_up(unsigned char *restrict out, const unsigned char *restrict row, const unsigned char *restrict prev, size_t stride, unsigned char bpp) {
+    size_t c;
+    for (c = 0; c < stride; c++) {
+        out[c] = row[c] - prev[c];
+    }
+}
+
+static void filter_avg(unsigned char *restrict out, const unsigned char *restrict row, const unsigned char *restrict prev, size_t stride, unsigned char bpp) {
+    size_t c, head = bpp < stride ? bpp : stride;
+    for (c = 0; c < head; c++) {
+        out[c] = row[c] - prev[c] / 2;
+    }
+    for (; c < stride; c++) {
+        out[c] = row[c] - (row[c - bpp] + prev[c]) / 2;
+    }
+}
+
+static void filter_paeth(unsigned char *restrict out, const unsigned char *restrict row, const unsigned char *restrict prev, size_t stride, unsigned char bpp) {
+    size_t c, head = bpp < stride ? bpp : stride;
+    for (c = 0; c < head; c++) {
+        out[c] = row[c] - paeth(0, prev[c], 0);
+    }
+    for (; c < stride; c++) {
+        out[c] = row[c] - paeth(row[c - bpp], prev[c], prev[c - bpp]);
+    }
+}
+
+/* 1 and 2 byte distances have no SIMD unfilter; fixing the distance lets the compiler unroll these loops */
+
+#define SCALAR_UNFILTER(N)                                                                                                           \
+static void unfilter_sub_##N(unsigned char *restrict row, const unsigned char *restrict prev, size_t stride, unsigned char bpp) {    \
+    size_t c;                                                                                                                        \
+    for (c = N; c < stride; c++) {                                                                                                   \
+        row[c] += row[c - N];                                                                                                        \
+    }                                                                                                                                \
+}                                                                                                                                    \
+                                                                                                                                     \
+static void unfilter_avg_##N(unsigned char *restrict row, const unsigned char *restrict prev, size_t stride, unsigned char bpp) {    \
+    size_t c, head = N < stride ? N : stride;                                                                                        \
+    for (c = 0; c < head; c++) {                                                                                                     \
+        row[c] += prev[c] / 2;                                                                                                       \
+    }                                                                                                                                \
+    for (; c < stride; c++) {                                                                                                        \
+        row[c] += (row[c - N] + prev[c]) / 2;                                                                                        \
+    }                                                                                                                                \
+}                                                                                                                                    \
+                                                                                                                                     \
+static void unfilter_paeth_##N(unsigned char *restrict row, const unsigned char *restrict prev, size_t stride, unsigned char bpp) {  \
+    size_t c, head = N < stride ? N : stride;                                                                                        \
+    for (c = 0; c < head; c++) {                                                                                                     \
+        row[c] += paeth(0, prev[c], 0);                                                                                              \
+    }                                                                                                                                \
+    for (; c < stride; c++) {                                                                                                        \
+        row[c] += paeth(row[c - N], prev[c], prev[c - N]);                                                                           \
+    }                                                                                                                                \
+}
+
+SCALAR_UNFILTER(1)
+SCALAR_UNFILTER(2)
+
+#define SCALAR_ROW(k, N)                       \
+    unfilter_tbl[1][k] = unfilter_sub_##N;     \
+    unfilter_tbl[3][k] = unfilter_avg_##N;     \
+    unfilter_tbl[4][k] = unfilter_paeth_##N;
+
+static size_t score_msad(const unsigned char *row, size_t len) {
+    size_t c, sum = 0;
+    for (c = 0; c < len; c++) {
+        sum += row[c] < 128 ? row[c] : 256 - row[c];
+    }
+    return sum;
+}
+
+static size_t score_entropy(const unsigned char *row, size_t len) {
+    uint32_t hist[256] = {0};
+    double bits = 0;
+    size_t c;
+
+    for (c = 0; c < len; c++) {
+        hist[row[c]]++;
+    }
+    for (c = 0; c < 256; c++) {
+        if (hist[c]) {
+            bits -= hist[c] * log2((double) hist[c] / (double) len);
+        }
+    }
+
+    return (size_t) bits;
+}
+
+#ifdef PNG_FILTER_X86
+
+#define SSE_TARGET __attribute__((target("sse2")))
+#define AVX2_TARGET __attribute__((target("avx2")))
+
+SSE_TARGET static inline __m128i sse_absdiff(__m128i x, __m128i y) {
+    return _mm_or_si128(_mm_subs_epu8(x, y), _mm_subs_epu8(y, x));
+}
+
+SSE_TARGET static inline __m128i sse_le(__m128i x, __m128i y) {
+    return _mm_cmpeq_epi8(_mm_min_epu8(x, y), x);
+}
+
+SSE_TARGET static inline __m128i sse_select(__m128i mask, __m128i x, __m128i y) {
+    return _mm_or_si128(_mm_and_si128(mask, x), _mm_andnot_si128(mask, y));
+}
+
+SSE_TARGET static inline __m128i sse_avg(__m128i a, __m128i b) {
+    return _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), _mm_set1_epi8(1)));
+}
+
+SSE_TARGET static inline __m128i sse_paeth(__m128i a, __m128i b, __m128i c) {
+    __m128i p = _mm_sub_epi8(_mm_add_epi8(a, b), c);
+    __m128i pa = sse_absdiff(p, a), pb = sse_absdiff(p, b), pc = sse_absdiff(p, c);
+    __m128i use_a = _mm_and_si128(sse_le(pa, pb), sse_le(pa, pc));
+    return sse_select(use_a, a, sse_select(sse_le(pb, pc), b, c));
+}
+
+AVX2_TARGET static inline __m256i avx2_absdiff(__m256i x, __m256i y) {
+    return _mm256_or_si256(_mm256_subs_epu8(x, y), _mm256_subs_epu8(y, x));
+}
+
+AVX2_TARGET static inline __m256i avx2_le(__m256i x, __m256i y) {
+    return _mm256_cmpeq_epi8(_mm256_min_epu8(x, y), x);
+}
+
+AVX2_TARGET static inline __m256i avx2_paeth(__m256i a, __m256i b, __m256i c) {
+    __m256i p = _mm256_sub_epi8(_mm256_add_epi8(a, b), c);
+    __m256i pa = avx2_absdiff(p, a), pb = avx2_absdiff(p, b), pc = avx2_absdiff(p, c);
+    __m256i use_a = _mm256_and_si256(avx2_le(pa, pb), avx2_le(pa, pc));
+    return _mm256_blendv_epi8(_mm256_blendv_epi8(c, b, avx2_le(pb, pc)), a, use_a);
+}
+
+AVX2_TARGET static inline __m256i avx2_avg(__m256i a, __m256i b) {
+    return _mm256_sub_epi8(_mm256_avg_epu8(a, b), _mm256_and_si256(_mm256_xor_si256(a, b), _mm256_set1_epi8(1)));
+}
+
+/* 16 bytes per pixel: every vector only depends on the one before it */
+
+SSE_TARGET static void unfilter_sub_sse2_16(unsigned char *restrict row, const unsigned char *restrict prev, size_t stride, unsigned char bpp) {
+    __m128i a = _mm_setzero_si128();
+    size_t c;
+    for (c = 0; c + 16 <= stride; c += 16) {
+        a = _mm_add_epi8(_mm_loadu_si128((const __m128i *) (row + c)), a);
+        _mm_storeu_si128((__m128i *) (row + c), a);
+    }
+    for (c = c > 16 ? c : 16; c < stride; c++) {
+        row[c] += row[c - 16];
+    }
+}
+
+SSE_TARGET static void unfilter_avg_sse2_16(unsigned char *restrict row, const unsigned char *restrict prev, size_t stride, unsigned char bpp) {
+    __m128i a = _mm_setzero_si128(), b;
+    size_t c;
+    for (c = 0; c + 16 <= stride; c += 16) {
+        b = _mm_loadu_si128((const __m128i *) (prev + c));
+        a = _mm_add_epi8(_mm_loadu_si128((const __m128i *) (row + c)), sse_avg(a, b));
+        _mm_storeu_si128((__m128i *) (row + c), a);
+    }
+    for (; c < stride; c++) {
+        row[c] += ((c >= 16 ? row[c - 16] : 0) + prev[c]) / 2;
+    }
+}
+
+SSE_TARGET static void unfilter_paeth_sse2_16(unsigned char *restrict row, const unsigned char *restrict prev, size_t stride, unsigned char bpp) {
+    __m128i a = _mm_setzero_si128(), b, c_ = _mm_setzero_si128();
+    size_t c;
+    for (c = 0; c + 16 <= stride; c += 16) {
+        b = _mm_loadu_si128((const __m128i *) (prev + c));
+        a = _mm_add_epi8(_mm_loadu_si128((const __m128i *) (row + c)), sse_paeth(a, b, c_));
+        _mm_storeu_si128((__m128i *) (row + c), a);
+        c_ = b;
+    }
+    for (; c < stride; c++) {
+        row[c] += c >= 16 ? paeth(row[c - 16], prev[c], prev[c - 16]) : paeth(0, prev[c], 0);
+    }
+}
+
+/* 8 and 4 bytes per pixel: one pixel per step in the low lanes */
+
+#define SSE_LOAD8(p) _mm_loadl_epi64((const __m128i *) (p))
+#define SSE_STORE8(p, x) _mm_storel_epi64((__m128i *) (p), (x))
+#define SSE_LOAD4(p) _mm_cvtsi32_si128(png_load32(p))
+#define SSE_STORE4(p, x) png_store32((p), _mm_cvtsi128_si32(x))
+
+static inline int png_load32(const unsigned char *p) {
+    int v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static inline void png_store32(unsigned char *p, int v) {
+    memcpy(p, &v, 4);
+}
+
+#define SSE_UNFILTER_NARROW(N)                                                                                                       \
+SSE_TARGET static void unfilter_sub_sse2_##N(unsigned char *restrict row, const unsigned char *restrict prev, size_t stride, unsigned char bpp) {   \
+    __m128i a = _mm_setzero_si128();                                                                                                 \
+    size_t c;                                                                                                                        \
+    for (c = 0; c + N <= stride; c += N) {                                                                                           \
+        a = _mm_add_epi8(SSE_LOAD##N(row + c), a);                                                                                   \
+        SSE_STORE##N(row + c, a);                                                                                                    \
+    }                                                                                                                                \
+    for (c = c > N ? c : N; c < stride; c++) {                                                                                       \
+        row[c] += row[c - N];                                                                                                        \
+    }                                                                                                                                \
+}                                                                                                                                    \
+                                                                                                                                     \
+SSE_TARGET static void unfilter_avg_sse2_##N(unsigned char *restrict row, const unsigned char *restrict prev, size_t stride, unsigned char bpp) {   \
+    __m128i a = _mm_setzero_si128(), b;                                                                                              \
+    size_t c;                                                                                                                        \
+    for (c = 0; c + N <= stride; c += N) {                                                                                           \
+        b = SSE_LOAD##N(prev + c);                                                                                                   \
+        a = _mm_add_epi8(SSE_LOAD##N(row + c), sse_avg(a, b));                                                                       \
+        SSE_STORE##N(row + c, a);                                                                                                    \
+    }                                                                                                                                \
+    for (; c < stride; c++) {                                                                                                        \
+        row[c] += ((c >= N ? row[c - N] : 0) + prev[c]) / 2;                                                                         \
+    }                                                                                                                                \
+}                                                                                                                                    \
+                                                                                                                                     \
+SSE_TARGET static void unfilter_paeth_sse2_##N(unsigned char *restrict row, const unsigned char *restrict prev, size_t stride, unsigned char bpp) { \
+    __m128i a = _mm_setzero_si128(), b, c_ = _mm_setzero_si128();                                                                    \
+    size_t c;                                                                                                                        \
+    for (c = 0; c + N <= stride; c += N) {                                                                                           \
+        b = SSE_LOAD##N(prev + c);                                                                                                   \
+        a = _mm_add_epi8(SSE_LOAD##N(row + c), sse_paeth(a, b, c_));                                                                 \
+        SSE_STORE##N(row + c, a);                                                                                                    \
+        c_ = b;                                                                                                                      \
+    }                                                                                                                                \
+    for (; c < stride; c++) {                                                                                                        \
+        row[c] += c >= N ? paeth(row[c - N], prev[c], prev[c - N]) : paeth(0, prev[c], 0);                                           \
+    }                                                                                                                                \
+}
+
+SSE_UNFILTER_NARROW(8)
+SSE_UNFILTER_NARROW(4)
+
+SSE_TARGET static void unfilter_up_sse2(unsigned char *restrict row, const unsigned char *restrict prev, size_t stride, unsigned char bpp) {
+    size_t c;
+    for (c = 0; c + 16 <= stride; c += 16) {
+        _mm_storeu_si128((__m128i *) (row + c), _mm_add_epi8(_mm_loadu_si128((const __m128i *) (row + c)),
+                                                             _mm_loadu_si128((const __m128i *) (prev + c))));
+    }
+    for (; c < stride; c++) {
+        row[c] += prev[c];
+    }
+}
+
+AVX2_TARGET static void unfilter_up_avx2(unsigned char *restrict row, const unsigned char *restrict prev, size_t stride, unsigned char bpp) {
+    size_t c;
+    for (c = 0; c + 32 <= stride; c += 32) {
+        _mm256_storeu_si256((__m256i *) (row + c), _mm256_add_epi8(_mm256_loadu_si256((const __m256i *) (row + c)),
+                                                                   _mm256_loadu_si256((const __m256i *) (prev + c))));
+    }
+    for (; c < stride; c++) {
+        row[c] += prev[c];
+    }
+}
+
+/* refiltering only reads the unfiltered rows, so every byte is independent */
+
+SSE_TARGET static void filter_sub_sse2(unsigned char *restrict out, const unsigned char *restrict row, const unsigned char *restrict prev, size_t stride, unsigned char bpp) {
+    size_t c, head = bpp < stride ? bpp : stride;
+    memcpy(out, row, head);
+    for (c = head; c + 16 <= stride; c += 16) {
+        _mm_storeu_si128((__m128i *) (out + c), _mm_sub_epi8(_mm_loadu_si128((const __m128i *) (row + c)),
+                                                             _mm_loadu_si128((const __m128i *) (row + c - bpp))));
+    }
+    for (; c < stride; c++) {
+        out[c] = row[c] - row[c - bpp];
+    }
+}
+
+SSE_TARGET static void filter_up_sse2(unsigned char *restrict out, const unsigned char *restrict row, const unsigned char *restrict prev, size_t stride, unsigned char bpp) {
+    size_t c;
+    for (c = 0; c + 16 <= stride; c += 16) {
+        _mm_storeu_si128((__m128i *) (out + c), _mm_sub_epi8(_mm_loadu_si128((const __m128i *) (row + c)),
+                                                             _mm_loadu_si128((const __m128i *) (prev + c))));
+    }
+    for (; c < stride; c++) {
+        out[c] = row[c] - prev[c];
+    }
+}
+
+SSE_TARGET static void filter_avg_sse2(unsigned char *restrict out, const unsigned char *restrict row, const unsigned char *restrict prev, size_t stride, unsigned char bpp) {
+    size_t c, head = bpp < stride ? bpp : stride;
+    for (c = 0; c < head; c++) {
+        out[c] = row[c] - prev[c] / 2;
+    }
+    for (; c + 16 <= stride; c += 16) {
+        __m128i avg = sse_avg(_mm_loadu_si128((const __m128i *) (row + c - bpp)), _mm_loadu_si128((const __m128i *) (prev + c)));
+        _mm_storeu_si128((__m128i *) (out + c), _mm_sub_epi8(_mm_loadu_si128((const __m128i *) (row + c)), avg));
+    }
+    for (; c < stride; c++) {
+        out[c] = row[c] - (row[c - bpp] + prev[c]) / 2;
+    }
+}
+
+SSE_TARGET static void filter_paeth_sse2(unsigned char *restrict out, const unsigned char *restrict row, const unsigned char *restrict prev, size_t stride, unsigned char bpp) {
+    size_t c, head = bpp < stride ? bpp : stride;
+    for (c = 0; c < head; c++) {
+        out[c] = row[c] - paeth(0, prev[c], 0);
+    }
+    for (; c + 16 <= stride; c += 16) {
+        __m128i pred = sse_paeth(_mm_loadu_si128((const __m128i *) (row + c - bpp)),
+                                 _mm_loadu_si128((const __m128i *) (prev + c)),
+                                 _mm_loadu_si128((const __m128i *) (prev + c - bpp)));
+        _mm_storeu_si128((__m128i *) (out + c), _mm_sub_epi8(_mm_loadu_si128((const __m128i *) (row + c)), pred));
+    }
+    for (; c < stride; c++) {
+        out[c] = row[c] - paeth(row[c - bpp], prev[c], prev[c - bpp]);
+    }
+}
+
+AVX2_TARGET static void filter_sub_avx2(unsigned char *restrict out, const unsigned char *restrict row, const unsigned char *restrict prev, size_t stride, unsigned char bpp) {
+    size_t c, head = bpp < stride ? bpp : stride;
+    memcpy(out, row, head);
+    for (c = head; c + 32 <= stride; c += 32) {
+        _mm256_storeu_si256((__m256i *) (out + c), _mm256_sub_epi8(_mm256_loadu_si256((const __m256i *) (row + c)),
+                                                                   _mm256_loadu_si256((const __m256i *) (row + c - bpp))));
+    }
+    for (; c < stride; c++) {
+        out[c] = row[c] - row[c - bpp];
+    }
+}
+
+AVX2_TARGET static void filter_up_avx2(unsigned char *restrict out, const unsigned char *restrict row, const unsigned char *restrict prev, size_t stride, unsigned char bpp) {
+    size_t c;
+    for (c = 0; c + 32 <= stride; c += 32) {
+        _mm256_storeu_si256((__m256i *) (out + c), _mm256_sub_epi8(_mm256_loadu_si256((const __m256i *) (row + c)),
+                                                                   _mm256_loadu_si256((const __m256i *) (prev + c))));
+    }
+    for (; c < stride; c++) {
+        out[c] = row[c] - prev[c];
+    }
+}
+
+AVX2_TARGET static void filter_avg_avx2(unsigned char *restrict out, const unsigned char *restrict row, const unsigned char *restrict prev, size_t stride, unsigned char bpp) {
+    size_t c, head = bpp < stride ? bpp : stride;
+    for (c = 0; c < head; c++) {
+        out[c] = row[c] - prev[c] / 2;
+    }
+    for (; c + 32 <= stride; c += 32) {
+        __m256i avg = avx2_avg(_mm256_loadu_si256((const __m256i *) (row + c - bpp)), _mm256_loadu_si256((const __m256i *) (prev + c)));
+        _mm256_storeu_si256((__m256i *) (out + c), _mm256_sub_epi8(_mm256_loadu_si256((const __m256i *) (row + c)), avg));
+    }
+    for (; c < stride; c++) {
+        out[c] = row[c] - (row[c - bpp] + prev[c]) / 2;
+    }
+}
+
+AVX2_TARGET static void filter_paeth_avx2(unsigned char *restrict out, const unsigned char *restrict row, const unsigned char *restrict prev, size_t stride, unsigned char bpp) {
+    size_t c, head = bpp < stride ? bpp : stride;
+    for (c = 0; c < head; c++) {
+        out[c] = row[c] - paeth(0, prev[c], 0);
+    }
+    for (; c + 32 <= stride; c += 32) {
+        __m256i pred = avx2_paeth(_mm256_loadu_si256((const __m256i *) (row + c - bpp)),
+                                  _mm256_loadu_si256((const __m256i *) (prev + c)),
+                                  _mm256_loadu_si256((const __m256i *) (prev + c - bpp)));
+        _mm256_storeu_si256((__m256i *) (out + c), _mm256_sub_epi8(_mm256_loadu_si256((const __m256i *) (row + c)), pred));
+    }
+    for (; c < stride; c++) {
+        out[c] = row[c] - paeth(row[c - bpp], prev[c], prev[c - bpp]);
+    }
+}
+
+SSE_TARGET static size_t score_msad_sse2(const unsigned char *row, size_t len) {
+    __m128i zero = _mm_setzero_si128(), sum = zero, v;
+    size_t c;
+    for (c = 0; c + 16 <= len; c += 16) {
+        v = _mm_loadu_si128((const __m128i *) (row + c));
+        sum = _mm_add_epi64(sum, _mm_sad_epu8(_mm_min_epu8(v, _mm_sub_epi8(zero, v)), zero));
+    }
+    return (size_t) _mm_cvtsi128_si64(sum) + (size_t) _mm_cvtsi128_si64(_mm_unpackhi_epi64(sum, sum)) +
+           score_msad(row + c, len - c);
+}
+
+AVX2_TARGET static size_t score_msad_avx2(const unsigned char *row, size_t len) {
+    __m256i zero = _mm256_setzero_si256(), sum = zero, v;
+    __m128i half;
+    size_t c;
+    for (c = 0; c + 32 <= len; c += 32) {
+        v = _mm256_loadu_si256((const __m256i *) (row + c));
+        sum = _mm256_add_epi64(sum, _mm256_sad_epu8(_mm256_min_epu8(v, _mm256_sub_epi8(zero, v)), zero));
+    }
+    half = _mm_add_epi64(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+    return (size_t) _mm_cvtsi128_si64(half) + (size_t) _mm_cvtsi128_si64(_mm_unpackhi_epi64(half, half)) +
+           score_msad(row + c, len - c);
+}
+
+#endif
+
+#ifdef PNG_FILTER_NEON
+
+static inline uint8x16_t neon_paeth(uint8x16_t a, uint8x16_t b, uint8x16_t c) {
+    uint8x16_t p = vsubq_u8(vaddq_u8(a, b), c);
+    uint8x16_t pa = vabdq_u8(p, a), pb = vabdq_u8(p, b), pc = vabdq_u8(p, c);
+    uint8x16_t use_a = vandq_u8(vcleq_u8(pa, pb), vcleq_u8(pa, pc));
+    return vbslq_u8(use_a, a, vbslq_u8(vcleq_u8(pb, pc), b, c));
+}
+
+static inline uint8x8_t neon_paeth8(uint8x8_t a, uint8x8_t b, uint8x8_t c) {
+    uint8x8_t p = vsub_u8(vadd_u8(a, b), c);
+    uint8x8_t pa = vabd_u8(p, a), pb = vabd_u8(p, b), pc = vabd_u8(p, c);
+    uint8x8_t use_a = vand_u8(vcle_u8(pa, pb), vcle_u8(pa, pc));
+    return vbsl_u8(use_a, a, vbsl_u8(vcle_u8(pb, pc), b, c));
+}
+
+static void unfilter_sub_neon_16(unsigned char *restrict row, const unsigned char *restrict prev, size_t stride, unsigned char bpp) {
+    uint8x16_t a = vdupq_n_u8(0);
+    size_t c;
+    for (c = 0; c + 16 <= stride; c += 16) {
+        a = vaddq_u8(vld1q_u8(row + c), a);
+        vst1q_u8(row + c, a);
+    }
+    for (c = c > 16 ? c : 16; c < stride; c++) {
+        row[c] += row[c - 16];
+    }
+}
+
+static void unfilter_avg_neon_16(unsigned char *restrict row, const unsigned char *restrict prev, size_t stride, unsigned char bpp) {
+    uint8x16_t a = vdupq_n_u8(0);
+    size_t c;
+    for (c = 0; c + 16 <= stride; c += 16) {
+        a = vaddq_u8(vld1q_u8(row + c), vhaddq_u8(a, vld1q_u8(prev + c)));
+        vst1q_u8(row + c, a);
+    }
+    for (; c < stride; c++) {
+        row[c] += ((c >= 16 ? row[c - 16] : 0) + prev[c]) / 2;
+    }
+}
+
+static void unfilter_paeth_neon_16(unsigned char *restrict row, const unsigned char *restrict prev, size_t stride, unsigned char bpp) {
+    uint8x16_t a = vdupq_n_u8(0), b, c_ = vdupq_n_u8(0);
+    size_t c;
+    for (c = 0; c + 16 <= stride; c += 16) {
+        b = vld1q_u8(prev + c);
+        a = vaddq_u8(vld1q_u8(row + c), neon_paeth(a, b, c_));
+        vst1q_u8(row + c, a);
+        c_ = b;
+    }
+    for (; c < stride; c++) {
+        row[c] += c >= 16 ? paeth(row[c - 16], prev[c], prev[c - 16]) : paeth(0, prev[c], 0);
+    }
+}
+
+static void unfilter_sub_neon_8(unsigned char *restrict row, const unsigned char *restrict prev, size_t stride, unsigned char bpp) {
+    uint8x8_t a = vdup_n_u8(0);
+    size_t c;
+    for (c = 0; c + 8 <= stride; c += 8) {
+        a = vadd_u8(vld1_u8(row + c), a);
+        vst1_u8(row + c, a);
+    }
+    for (c = c > 8 ? c : 8; c < stride; c++) {
+        row[c] += row[c - 8];
+    }
+}
+
+static void unfilter_avg_neon_8(unsigned char *restrict row, const unsigned char *restrict prev, size_t stride, unsigned char bpp) {
+    uint8x8_t a = vdup_n_u8(0);
+    size_t c;
+    for (c = 0; c + 8 <= stride; c += 8) {
+        a = vadd_u8(vld1_u8(row + c), vhadd_u8(a, vld1_u8(prev + c)));
+        vst1_u8(row + c, a);
+    }
+    for (; c < stride; c++) {
+        row[c] += ((c >= 8 ? row[c - 8] : 0) + prev[c]) / 2;
+    }
+}
+
+static void unfilter_paeth_neon_8(unsigned char *restrict row, const unsigned char *restrict prev, size_t stride, unsigned char bpp) {
+    uint8x8_t a = vdup_n_u8(0), b, c_ = vdup_n_u8(0);
+    size_t c;
+    for (c = 0; c + 8 <= stride; c += 8) {
+        b = vld1_u8(prev + c);
+        a = vadd_u8(vld1_u8(row + c), neon_paeth8(a, b, c_));
+        vst1_u8(row + c, a);
+        c_ = b;
+    }
+    for (; c < stride; c++) {
+        row[c] += c >= 8 ? paeth(row[c - 8], prev[c], prev[c - 8]) : paeth(0, prev[c], 0);
+    }
+}
+
+static void unfilter_up_neon(unsigned char *restrict row, const unsigned char *restrict prev, size_t stride, unsigned char bpp) {
+    size_t c;
+    for (c = 0; c + 16 <= stride; c += 16) {
+        vst1q_u8(row + c, vaddq_u8(vld1q_u8(row + c), vld1q_u8(prev + c)));
+    }
+    for (; c < stride; c++) {
+        row[c] += prev[c];
+    }
+}
+
+static void filter_sub_neon(unsigned char *restrict out, const unsigned char *restrict row, const unsigned char *restrict prev, size_t stride, unsigned char bpp) {
+    size_t c, head = bpp < stride ? bpp : stride;
+    memcpy(out, row, head);
+    for (c = head; c + 16 <= stride; c += 16) {
+        vst1q_u8(out + c, vsubq_u8(vld1q_u8(row + c), vld1q_u8(row + c - bpp)));
+    }
+    for (; c < stride; c++) {
+        out[c] = row[c] - row[c - bpp];
+    }
+}
+
+static void filter_up_neon(unsigned char *restrict out, const unsigned char *restrict row, const unsigned char *restrict prev, size_t stride, unsigned char bpp) {
+    size_t c;
+    for (c = 0; c + 16 <= stride; c += 16) {
+        vst1q_u8(out + c, vsubq_u8(vld1q_u8(row + c), vld1q_u8(prev + c)));
+    }
+    for (; c < stride; c++) {
+        out[c] = row[c] - prev[c];
+    }
+}
+
+static void filter_avg_neon(unsigned char *restrict out, const unsigned char *restrict row, const unsigned char *restrict prev, size_t stride, unsigned char bpp) {
+    size_t c, head = bpp < stride ? bpp : stride;
+    for (c = 0; c < head; c++) {
+        out[c] = row[c] - prev[c] / 2;
+    }
+    for (; c + 16 <= stride; c += 16) {
+        vst1q_u8(out + c, vsubq_u8(vld1q_u8(row + c), vhaddq_u8(vld1q_u8(row + c - bpp), vld1q_u8(prev + c))));
+    }
+    for (; c < stride; c++) {
+        out[c] = row[c] - (row[c - bpp] + prev[c]) / 2;
+    }
+}
+
+static void filter_paeth_neon(unsigned char *restrict out, const unsigned char *restrict row, const unsigned char *restrict prev, size_t stride, unsigned char bpp) {
+    size_t c, head = bpp < stride ? bpp : stride;
+    for (c = 0; c < head; c++) {
+        out[c] = row[c] - paeth(0, prev[c], 0);
+    }
+    for (; c + 16 <= stride; c += 16) {
+        uint8x16_t pred = neon_paeth(vld1q_u8(row + c - bpp), vld1q_u8(prev + c), vld1q_u8(prev + c - bpp));
+        vst1q_u8(out + c, vsubq_u8(vld1q_u8(row + c), pred));
+    }
+    for (; c < stride; c++) {
+        out[c] = row[c] - paeth(row[c - bpp], prev[c], prev[c - bpp]);
+    }
+}
+
+static size_t score_msad_neon(const unsigned char *row, size_t len) {
+    uint64x2_t sum = vdupq_n_u64(0);
+    uint8x16_t v;
+    size_t c;
+    for (c = 0; c + 16 <= len; c += 16) {
+        v = vld1q_u8(row + c);
+        sum = vpadalq_u32(sum, vpaddlq_u16(vpaddlq_u8(vminq_u8(v, vreinterpretq_u8_s8(vnegq_s8(vreinterpretq_s8_u8(v)))))));
+    }
+    return (size_t) vaddvq_u64(sum) + score_msad(row + c, len - c);
+}
+
+#endif
+
+static void png_filter_kernels_init(void) {
+    int k;
+
+    for (k = 0; k < PNG_BPP_CLASSES; k++) {
+        unfilter_tbl[0][k] = unfilter_none;
+        unfilter_tbl[1][k] = unfilter_sub;
+        unfilter_tbl[2][k] = unfilter_up;
+        unfilter_tbl[3][k] = unfilter_avg;
+        unfilter_tbl[4][k] = unfilter_paeth;
+
+        filter_tbl[0][k] = filter_none;
+        filter_tbl[1][k] = filter_sub;
+        filter_tbl[2][k] = filter_up;
+        filter_tbl[3][k] = filter_avg;
+        filter_tbl[4][k] = filter_paeth;
+    }
+    SCALAR_ROW(0, 1)
+    SCALAR_ROW(1, 2)
+    filter_score = score_msad;
+    filter_isa = "scalar";
+
+#ifdef PNG_FILTER_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+        for (k = 0; k < PNG_BPP_CLASSES; k++) {
+            unfilter_tbl[2][k] = unfilter_up_sse2;
+            filter_tbl[1][k] = filter_sub_sse2;
+            filter_tbl[2][k] = filter_up_sse2;
+            filter_tbl[3][k] = filter_avg_sse2;
+            filter_tbl[4][k] = filter_paeth_sse2;
+        }
+        unfilter_tbl[1][2] = unfilter_sub_sse2_4;
+        unfilter_tbl[3][2] = unfilter_avg_sse2_4;
+        unfilter_tbl[4][2] = unfilter_paeth_sse2_4;
+        unfilter_tbl[1][3] = unfilter_sub_sse2_8;
+        unfilter_tbl[3][3] = unfilter_avg_sse2_8;
+        unfilter_tbl[4][3] = unfilter_paeth_sse2_8;
+        unfilter_tbl[1][4] = unfilter_sub_sse2_16;
+        unfilter_tbl[3][4] = unfilter_avg_sse2_16;
+        unfilter_tbl[4][4] = unfilter_paeth_sse2_16;
+        filter_score = score_msad_sse2;
+        filter_isa = "sse2";
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        for (k = 0; k < PNG_BPP_CLASSES; k++) {
+            unfilter_tbl[2][k] = unfilter_up_avx2;
+            filter_tbl[1][k] = filter_sub_avx2;
+            filter_tbl[2][k] = filter_up_avx2;
+            filter_tbl[3][k] = filter_avg_avx2;
+            filter_tbl[4][k] = filter_paeth_avx2;
+        }
+        filter_score = score_msad_avx2;
+        filter_isa = "avx2";
+    }
+#endif
+
+#ifdef PNG_FILTER_NEON
+    for (k = 0; k < PNG_BPP_CLASSES; k++) {
+        unfilter_tbl[2][k] = unfilter_up_neon;
+        filter_tbl[1][k] = filter_sub_neon;
+        filter_tbl[2][k] = filter_up_neon;
+        filter_tbl[3][k] = filter_avg_neon;
+        filter_tbl[4][k] = filter_paeth_neon;
+    }
+    unfilter_tbl[1][3] = unfilter_sub_neon_8;
+    unfilter_tbl[3][3] = unfilter_avg_neon_8;
+    unfilter_tbl[4][3] = unfilter_paeth_neon_8;
+    unfilter_tbl[1][4] = unfilter_sub_neon_16;
+    unfilter_tbl[3][4] = unfilter_avg_neon_16;
+    unfilter_tbl[4][4] = unfilter_paeth_neon_16;
+    filter_score = score_msad_neon;
+    filter_isa = "neon";
+#endif
+}
+
+void png_unfilter_kernels(unsigned char bpp, png_unfilter_fn kernels[5]) {
+    int f;
+
+    pthread_once(&filter_once, png_filter_kernels_init);
+    for (f = 0; f < 5; f++) {
+        kernels[f] = unfilter_tbl[f][png_bpp_class(bpp)];
+    }
+}
+
+png_filter_fn png_filter_kernel(unsigned char filter_method, unsigned char bpp) {
+    pthread_once(&filter_once, png_filter_kernels_init);
+    return filter_method > 4 ? NULL : filter_tbl[filter_method][png_bpp_class(bpp)];
+}
+
+const char *png_filter_isa(void) {
+    pthread_once(&filter_once, png_filter_kernels_init);
+    return filter_isa;
+}
+
+void png_filter_row(unsigned char *restrict filtered, const unsigned char *restrict row, const unsigned char *restrict prev, size_t stride, unsigned char bpp, unsigned char filter_method) {
+    filtered[0] = filter_method;
+    png_filter_kernel(filter_method, bpp)(filtered + 1, row, prev, stride, bpp);
+}
+
+void png_filter_row_adaptive(unsigned char *restrict filtered, const unsigned char *restrict row, const unsigned char *restrict prev,
+                             size_t stride, unsigned char bpp, unsigned char policy, unsigned char *restrict scratch) {
+    size_t (*score)(const unsigned char *, size_t);
+    size_t cost, best_cost;
+    unsigned char best = 0, f;
+
+    pthread_once(&filter_once, png_filter_kernels_init);
+    score = policy == PNG_FILTER_ENTROPY ? score_entropy : filter_score;
+
+    best_cost = score(row, stride);
+    for (f = 1; f < 5; f++) {
+        filter_tbl[f][png_bpp_class(bpp)](scratch + (f - 1) * stride, row, prev, stride, bpp);
+        if ((cost = score(scratch + (f - 1) * stride, stride)) < best_cost) {
+            best_cost = cost;
+            best = f;
+        }
+    }
+
+    filtered[0] = best;
+    memcpy(filtered + 1, best ? scratch + (best - 1) * stride : row, stride);
+}
+
+static const char *png_filter_names[] = {"none", "sub", "up", "avg", "paeth", "msad", "entropy"};
+
+const char *png_filter_name(int policy) {
+    return policy >= 0 && policy <= PNG_FILTER_ENTROPY ? png_filter_names[policy] : "unknown";
+}
+
+int png_filter_policy(const char *name) {
+    char *end;
+    long value;
+    int i;
+
+    for (i = 0; i <= PNG_FILTER_ENTROPY; i++) {
+        if (!strcmp(name, png_filter_names[i])) {
+            return i;
+        }
+    }
+
+    value = strtol(name, &end, 10);
+    return end != name && *end == '\0' && value >= 0 && value <= PNG_FILTER_ENTROPY ? (int) value : -1;
+}
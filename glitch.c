@@ -0,0 +1,414 @@
+#include "png.h"
+
+/* deflate never expands more than 1032:1, so larger IHDR dimensions cannot fit the file */
+#define PNG_ZLIB_MAX_RATIO 1032
+
+struct png_ctx *png_ctx_create(void) {
+    struct png_ctx *ctx = (struct png_ctx *) calloc(1, sizeof(*ctx));
+    if (NULL == ctx) {
+        return NULL;
+    }
+
+    ctx->inflate_strm.zalloc = Z_NULL;
+    ctx->inflate_strm.zfree = Z_NULL;
+    ctx->inflate_strm.opaque = Z_NULL;
+    ctx->inflate_strm.avail_in = 0;
+    ctx->inflate_strm.next_in = Z_NULL;
+    if (Z_OK != inflateInit(&ctx->inflate_strm)) {
+        free(ctx);
+        return NULL;
+    }
+
+    ctx->deflate_strm.zalloc = Z_NULL;
+    ctx->deflate_strm.zfree = Z_NULL;
+    ctx->deflate_strm.opaque = Z_NULL;
+    if (Z_OK != deflateInit(&ctx->deflate_strm, Z_DEFAULT_COMPRESSION)) {
+        inflateEnd(&ctx->inflate_strm);
+        free(ctx);
+        return NULL;
+    }
+
+    return ctx;
+}
+
+void png_ctx_destroy(struct png_ctx *ctx) {
+    size_t i;
+
+    if (NULL == ctx) {
+        return;
+    }
+
+    inflateEnd(&ctx->inflate_strm);
+    deflateEnd(&ctx->deflate_strm);
+    png_index_free(&ctx->index);
+    png_emit_free(&ctx->emitter);
+    png_buffer_free(&ctx->inflated);
+    png_buffer_free(&ctx->image);
+    png_buffer_free(&ctx->filtered);
+    png_buffer_free(&ctx->compressed);
+    png_buffer_free(&ctx->output);
+    png_buffer_free(&ctx->zero);
+    png_buffer_free(&ctx->candidates);
+    png_buffer_free(&ctx->deinterlaced);
+    for (i = 0; i < PNG_RACE_CONFIGS; i++) {
+        png_buffer_free(&ctx->race[i]);
+    }
+    png_arena_free(&ctx->arena);
+    png_cache_release(&ctx->cache);
+    png_raw_close(ctx);
+    free(ctx);
+}
+
+void png_opts_init(struct png_opts *opts) {
+    static const struct png_opts defaults = {
+            .filter_method = PNG_FILTER_PAETH,
+            .deflate_threads = 1,
+            .block_size = 128 << 10,
+            .cache_size = (size_t) 1024 << 20,
+            .filter_threads = 1,
+    };
+
+    *opts = defaults;
+}
+
+const char *png_ctx_deflate_config(const struct png_ctx *ctx) {
+    return ctx->deflate_config;
+}
+
+static int png_glitch_stream(struct png_ctx *ctx, const struct png_stats *stats, const char *output, const struct png_opts *opts) {
+    struct png_output out;
+    int err;
+
+    if (PNG_OK != (err = png_output_begin(&out, output))) {
+        return err;
+    }
+
+    if (!png_write_all(out.fd, ctx->index.base, 8)) {
+        err = PNG_ERR_IO;
+    } else if (opts->pipeline) {
+        err = png_pipeline_glitch(ctx, &ctx->index, stats, out.fd, opts->filter_method);
+    } else {
+        err = png_stream_glitch(ctx, &ctx->index, stats, out.fd, opts->filter_method);
+    }
+
+    return png_output_end(&out, err);
+}
+
+int png_glitch_open(struct png_ctx *ctx, const char *input) {
+    int err;
+
+    if (strcmp(input, "-") != 0) {
+        return png_index_open(&ctx->index, input);
+    }
+
+    PNG_TRACE_BEGIN(PNG_STAGE_INFLATE, 0)
+    err = png_index_receive(ctx, &ctx->index, STDIN_FILENO);
+    PNG_TRACE_END(PNG_STAGE_INFLATE, ctx->inflated.len)
+
+    return err;
+}
+
+int png_glitch_parse(struct png_ctx *ctx, struct png_stats *stats) {
+    int err;
+
+    PNG_TRACE_BEGIN(PNG_STAGE_PARSE, ctx->index.size)
+    err = png_index_parse(&ctx->index);
+    PNG_TRACE_END(PNG_STAGE_PARSE, ctx->index.count * sizeof(*ctx->index.chunks))
+
+    if (PNG_OK != err) {
+        return err;
+    }
+
+    png_index_stats(&ctx->index, stats);
+    if (PNG_OK != (err = png_validate_ihdr(stats))) {
+        return err;
+    }
+
+    ctx->deflate_config = NULL;
+
+    if (png_trace_active) {
+        png_trace_active->width = stats->width;
+        png_trace_active->height = stats->height;
+        png_trace_active->bit_depth = stats->bit_depth;
+        png_trace_active->color_type = stats->color_type;
+        png_trace_active->bytes_in = ctx->index.size;
+    }
+
+    return PNG_OK;
+}
+
+static int png_glitch_progressive(struct png_ctx *ctx, const struct png_stats *stats, const struct png_opts *opts,
+                                  const unsigned char *cached, size_t *reconstructed_size) {
+    const unsigned char *image = cached;
+    int err;
+
+    if (NULL == image) {
+        if (ctx->inflated.len < stats->height) {
+            return PNG_ERR_TRUNCATED;
+        }
+
+        *reconstructed_size = ctx->inflated.len - stats->height;
+        PNG_TRACE_BEGIN(PNG_STAGE_UNFILTER, ctx->inflated.len)
+        err = png_reconstruct_image(ctx, ctx->inflated.data, *reconstructed_size, stats, &ctx->image);
+        PNG_TRACE_END(PNG_STAGE_UNFILTER, *reconstructed_size)
+        if (PNG_OK != err) {
+            return err;
+        }
+        image = ctx->image.data;
+    } else {
+        *reconstructed_size = png_row_stride(stats) * stats->height;
+    }
+
+    PNG_TRACE_BEGIN(PNG_STAGE_REFILTER, *reconstructed_size)
+    if (opts->filter_threads > 1) {
+        err = png_filter_image_parallel(ctx, image, *reconstructed_size, stats, opts->filter_method, &ctx->filtered,
+                                        opts->filter_threads);
+    } else if (opts->filter_method > PNG_FILTER_PAETH) {
+        err = png_filter_image_adaptive(ctx, image, *reconstructed_size, stats, opts->filter_method, &ctx->filtered);
+    } else {
+        err = png_filter_image_fixed(ctx, image, *reconstructed_size, stats, opts->filter_method, &ctx->filtered);
+    }
+    PNG_TRACE_END(PNG_STAGE_REFILTER, ctx->filtered.len)
+
+    return err;
+}
+
+static _Bool png_glitch_reserve(struct png_ctx *ctx, const struct png_stats *stats, const struct png_opts *opts) {
+    struct png_adam7_pass passes[7];
+    size_t raw = png_row_stride(stats) * stats->height;
+    size_t inflated = raw + stats->height, image = raw;
+
+    if (stats->interlace_method) {
+        inflated = png_adam7_passes(stats, passes);
+        image = passes[6].image_offset + passes[6].stride * passes[6].height;
+    }
+    if (inflated / PNG_ZLIB_MAX_RATIO > ctx->index.size) {
+        return 1;
+    }
+
+    return png_buffer_reserve(&ctx->inflated, inflated + 1) &&
+           png_buffer_reserve(&ctx->image, image) &&
+           png_buffer_reserve(&ctx->filtered, inflated > raw + stats->height ? inflated : raw + stats->height) &&
+           png_buffer_reserve(&ctx->compressed, deflateBound(&ctx->deflate_strm, inflated)) &&
+           (!stats->interlace_method || !opts->progressive || png_buffer_reserve(&ctx->deinterlaced, raw));
+}
+
+int png_glitch_inflate(struct png_ctx *ctx, const struct png_stats *stats, const struct png_opts *opts,
+                       const unsigned char **cached) {
+    int err;
+
+    *cached = ctx->raw.pixels;
+    if (NULL != *cached) {
+        return PNG_OK;
+    }
+
+    if (!png_glitch_reserve(ctx, stats, opts)) {
+        return PNG_ERR_NOMEM;
+    }
+
+    if (NULL != opts->cache_dir) {
+        PNG_TRACE_BEGIN(PNG_STAGE_CACHE, ctx->index.size)
+        png_cache_key(&ctx->cache, &ctx->index);
+        *cached = png_cache_lookup(&ctx->cache, stats, opts->cache_dir);
+        PNG_TRACE_END(PNG_STAGE_CACHE, *cached ? ctx->cache.map_len : 0)
+        if (png_trace_active) {
+            png_trace_active->cache = *cached ? "hit" : "miss";
+        }
+    }
+
+    if (NULL == *cached && !ctx->index.inflated) {
+        PNG_TRACE_BEGIN(PNG_STAGE_INFLATE, ctx->index.size)
+        err = png_index_decompress(ctx, &ctx->index, &ctx->inflated);
+        PNG_TRACE_END(PNG_STAGE_INFLATE, ctx->inflated.len)
+        if (PNG_OK != err) {
+            return err;
+        }
+    }
+
+    return PNG_OK;
+}
+
+void png_glitch_remember(struct png_ctx *ctx, const struct png_stats *stats, const struct png_opts *opts) {
+    if (NULL == opts->cache_dir) {
+        return;
+    }
+
+    PNG_TRACE_BEGIN(PNG_STAGE_CACHE, png_cache_image_size(stats))
+    png_cache_store(&ctx->cache, stats, ctx->image.data, opts->cache_dir, opts->cache_size);
+    PNG_TRACE_END(PNG_STAGE_CACHE, 0)
+}
+
+static int png_glitch_image(struct png_ctx *ctx, const struct png_stats *stats, const struct png_opts *opts, _Bool encode) {
+    const unsigned char *cached;
+    size_t reconstructed_size;
+    int err;
+
+    if (PNG_OK != (err = png_glitch_inflate(ctx, stats, opts, &cached))) {
+        return err;
+    }
+
+    if (stats->interlace_method) {
+        reconstructed_size = png_cache_image_size(stats);
+        err = png_adam7_glitch(ctx, stats, opts, cached);
+    } else {
+        err = png_glitch_progressive(ctx, stats, opts, cached, &reconstructed_size);
+    }
+    png_cache_release(&ctx->cache);
+    if (PNG_OK != err) {
+        return err;
+    }
+
+    if (NULL == cached && reconstructed_size == png_cache_image_size(stats)) {
+        png_glitch_remember(ctx, stats, opts);
+    }
+    if (!encode) {
+        return PNG_OK;
+    }
+
+    PNG_TRACE_BEGIN(PNG_STAGE_DEFLATE, ctx->filtered.len)
+    if (opts->preview) {
+        err = png_preview_compress(ctx, ctx->filtered.data, ctx->filtered.len, &ctx->compressed);
+        ctx->deflate_config = "preview";
+    } else if (opts->race) {
+        err = png_zlib_compress_race(ctx->race, ctx->filtered.data, ctx->filtered.len, &ctx->compressed,
+                                     opts->race_budget_ms, &ctx->deflate_config);
+    } else if (opts->deflate_threads > 1) {
+        err = png_zlib_compress_parallel(&ctx->arena, ctx->filtered.data, ctx->filtered.len, &ctx->compressed,
+                                         opts->deflate_threads, opts->block_size);
+        ctx->deflate_config = "level=6 parallel";
+    } else {
+        err = png_zlib_compress(ctx, ctx->filtered.data, ctx->filtered.len, &ctx->compressed);
+        ctx->deflate_config = "level=6";
+    }
+    PNG_TRACE_END(PNG_STAGE_DEFLATE, ctx->compressed.len)
+    if (PNG_OK != err) {
+        return err;
+    }
+    png_effects_corrupt(&ctx->effects, ctx->compressed.data, ctx->compressed.len, 0);
+
+    if (png_trace_active) {
+        png_trace_active->raw_bytes = reconstructed_size;
+        png_trace_active->compressed_bytes = ctx->compressed.len;
+        png_trace_active->deflate_config = ctx->deflate_config;
+    }
+
+    return PNG_OK;
+}
+
+const unsigned char *png_glitch_ihdr(struct png_ctx *ctx, const struct png_stats *stats, const struct png_opts *opts) {
+    if (!stats->interlace_method || !opts->progressive) {
+        return NULL;
+    }
+
+    png_adam7_ihdr(&ctx->index, ctx->ihdr);
+    return ctx->ihdr;
+}
+
+int png_glitch_buffer(struct png_ctx *ctx, const unsigned char *input, size_t input_len,
+                      const unsigned char **output, size_t *output_len, const struct png_opts *opts) {
+
+    struct png_stats image_info;
+    int err;
+
+    if (NULL == ctx || NULL == input || NULL == output || NULL == output_len || NULL == opts || opts->filter_method > PNG_FILTER_ENTROPY) {
+        return PNG_ERR_ARG;
+    }
+
+    png_arena_reset(&ctx->arena);
+    png_index_attach(&ctx->index, input, input_len);
+
+    if (PNG_OK == (err = png_glitch_parse(ctx, &image_info)) &&
+        PNG_OK == (err = png_effects_parse(&ctx->effects, opts->effects, &image_info)) &&
+        PNG_OK == (err = png_glitch_image(ctx, &image_info, opts, 1)) &&
+        PNG_OK == (err = png_emit_build(&ctx->emitter, &ctx->index, png_glitch_ihdr(ctx, &image_info, opts),
+                                       ctx->compressed.data, ctx->compressed.len, 1 << 16))) {
+        err = png_emit_flatten(&ctx->emitter, &ctx->output);
+    }
+
+    png_index_close(&ctx->index);
+
+    if (PNG_OK == err) {
+        *output = ctx->output.data;
+        *output_len = ctx->output.len;
+    }
+
+    return err;
+}
+
+/* the streaming paths have no cache, race, preview encoder or thread pools, so those options go down the buffered path */
+static _Bool png_glitch_streamable(const struct png_opts *opts) {
+    return (opts->stream || opts->pipeline) && !opts->preview && !opts->race && NULL == opts->cache_dir &&
+           opts->deflate_threads <= 1 && opts->filter_threads <= 1;
+}
+
+static int png_glitch_run(struct png_ctx *ctx, const char *input, const char *output, const struct png_opts *opts) {
+    struct png_stats image_info;
+    struct png_opts progressive;
+    int kind = png_raw_kind(output), err;
+
+    png_arena_reset(&ctx->arena);
+    if (PNG_OK != (err = png_glitch_open(ctx, input))) {
+        return err;
+    }
+
+    if (PNG_OK != (err = png_raw_attach(ctx, opts->raw_format)) || PNG_OK != (err = png_glitch_parse(ctx, &image_info)) ||
+        PNG_OK != (err = png_effects_parse(&ctx->effects, opts->effects, &image_info))) {
+        png_raw_close(ctx);
+        png_index_close(&ctx->index);
+        return err;
+    }
+    if (NULL != ctx->raw.pixels && png_trace_active) {
+        png_trace_active->bytes_in = ctx->raw.source.size;
+    }
+
+    if (PNG_RAW_NONE != kind && image_info.interlace_method && !opts->progressive) {
+        progressive = *opts;
+        progressive.progressive = 1;
+        opts = &progressive;
+    }
+
+    if (png_glitch_streamable(opts) && !image_info.interlace_method && NULL == ctx->raw.pixels && PNG_RAW_NONE == kind) {
+        PNG_TRACE_BEGIN(PNG_STAGE_STREAM, ctx->index.size)
+        err = png_glitch_stream(ctx, &image_info, output, opts);
+        PNG_TRACE_END(PNG_STAGE_STREAM, png_trace_active->compressed_bytes)
+    } else if (PNG_OK == (err = png_glitch_image(ctx, &image_info, opts, PNG_RAW_NONE == kind)) && PNG_RAW_NONE != kind) {
+        err = png_raw_write(ctx, &image_info, output, kind);
+    } else if (PNG_OK == err) {
+        PNG_TRACE_BEGIN(PNG_STAGE_WRITE, ctx->compressed.len)
+        err = png_emit_image(ctx, output, &ctx->index, png_glitch_ihdr(ctx, &image_info, opts),
+                             ctx->compressed.data, ctx->compressed.len, 1 << 16, opts->mmap_output);
+        PNG_TRACE_END(PNG_STAGE_WRITE, ctx->emitter.total)
+    }
+
+    png_raw_close(ctx);
+    png_index_close(&ctx->index);
+
+    return err;
+}
+
+int png_glitch_file(struct png_ctx *ctx, const char *input, const char *output, const struct png_opts *opts) {
+    struct stat st;
+    int err;
+
+    if (NULL == ctx || NULL == input || NULL == output || NULL == opts || opts->filter_method > PNG_FILTER_ENTROPY) {
+        return PNG_ERR_ARG;
+    }
+
+    if (!opts->stats_json) {
+        return png_glitch_run(ctx, input, output, opts);
+    }
+
+    png_trace_start(&ctx->trace);
+    err = png_glitch_run(ctx, input, output, opts);
+    png_trace_stop(&ctx->trace);
+
+    ctx->trace.ok = PNG_OK == err;
+    if (ctx->trace.ok && !strcmp(output, "-")) {
+        ctx->trace.bytes_out = ctx->emitter.total;
+    } else if (ctx->trace.ok && stat(output, &st) == 0) {
+        ctx->trace.bytes_out = (size_t) st.st_size;
+    }
+    png_trace_report(&ctx->trace, input, output);
+
+    return err;
+}
@@ -1,5 +1,7 @@
 #include "png.h"
 
+#include <errno.h>
+
 uint32_t crc(const unsigned char *data, uint32_t offset, uint32_t len, const uint32_t *tbl) {
     uint32_t i, c, crc = 0;
 
@@ -17,7 +19,9 @@ uint32_t *mk_crc_tbl() {
     uint32_t c;
     uint16_t i, j;
     uint32_t *crc_table = (uint32_t *) calloc(256, sizeof(*crc_table));
-    CHALLOC(crc_table)
+    if (NULL == crc_table) {
+        return NULL;
+    }
 
     for (i = 0; i <= 255; i++) {
         c = i;
@@ -47,3 +51,135 @@ void print_hex(const unsigned char *restrict ptr, size_t size) {
     }
     putchar('\n');
 }
+
+int png_output_begin(struct png_output *out, const char *path) {
+    out->path = path;
+    if (!strcmp(path, "-")) {
+        out->fd = STDOUT_FILENO;
+        return PNG_OK;
+    }
+
+    if (snprintf(out->temp, sizeof(out->temp), "%s.XXXXXX", path) >= (int) sizeof(out->temp)) {
+        return PNG_ERR_ARG;
+    }
+    if ((out->fd = mkstemp(out->temp)) == -1) {
+        return PNG_ERR_IO;
+    }
+
+    return PNG_OK;
+}
+
+int png_output_end(struct png_output *out, int err) {
+    if (out->fd == STDOUT_FILENO) {
+        return err;
+    }
+
+    if (close(out->fd) != 0 && PNG_OK == err) {
+        err = PNG_ERR_IO;
+    }
+    if (PNG_OK == err && rename(out->temp, out->path) != 0) {
+        err = PNG_ERR_IO;
+    }
+    if (PNG_OK != err) {
+        unlink(out->temp);
+    }
+
+    return err;
+}
+
+_Bool png_write_all(int fd, const unsigned char *buffer, size_t len) {
+    ssize_t written;
+
+    while (len > 0) {
+        if ((written = write(fd, buffer, len)) < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return 0;
+        }
+        buffer += written;
+        len -= written;
+    }
+
+    return 1;
+}
+
+_Bool png_write_chunk(int fd, const unsigned char *type, const unsigned char *data, uint32_t len) {
+    unsigned char hdr[8];
+    uint32_t be_len = byteswap_ulong(len);
+    uint32_t checksum = byteswap_ulong(png_crc32(png_crc32(0, type, 4), data, len));
+    struct iovec iov[3];
+    size_t total = 12 + (size_t) len;
+    ssize_t written;
+
+    memcpy(hdr, &be_len, 4);
+    memcpy(hdr + 4, type, 4);
+
+    iov[0].iov_base = hdr;
+    iov[0].iov_len = 8;
+    iov[1].iov_base = (void *) data;
+    iov[1].iov_len = len;
+    iov[2].iov_base = &checksum;
+    iov[2].iov_len = 4;
+
+    if ((written = writev(fd, iov, 3)) == (ssize_t) total) {
+        return 1;
+    }
+    if (written < 0 && errno == EINTR) {
+        written = 0;
+    } else if (written < 0) {
+        return 0;
+    }
+
+    if ((size_t) written < 8) {
+        return png_write_all(fd, hdr + written, 8 - written) && png_write_all(fd, data, len) &&
+               png_write_all(fd, (const unsigned char *) &checksum, 4);
+    }
+    written -= 8;
+    if ((size_t) written < len) {
+        return png_write_all(fd, data + written, len - written) && png_write_all(fd, (const unsigned char *) &checksum, 4);
+    }
+    written -= len;
+    return png_write_all(fd, (const unsigned char *) &checksum + written, 4 - written);
+}
+
+_Bool png_buffer_reserve(struct png_buffer *buffer, size_t size) {
+    unsigned char *temp;
+    size_t capacity;
+
+    if (size <= buffer->capacity) {
+        return 1;
+    }
+
+    capacity = buffer->capacity ? buffer->capacity * 2 : CHUNK;
+    if (capacity < size) {
+        capacity = size;
+    }
+
+    temp = (unsigned char *) png_realloc(buffer->data, capacity);
+    if (NULL == temp) {
+        return 0;
+    }
+    buffer->data = temp;
+    buffer->capacity = capacity;
+
+    return 1;
+}
+
+const unsigned char *png_buffer_zero(struct png_buffer *buffer, size_t size) {
+    size_t old = buffer->capacity;
+
+    if (!png_buffer_reserve(buffer, size)) {
+        return NULL;
+    }
+    if (buffer->capacity > old) {
+        memset(buffer->data + old, 0, buffer->capacity - old);
+    }
+
+    return buffer->data;
+}
+
+void png_buffer_free(struct png_buffer *buffer) {
+    free(buffer->data);
+    memset(buffer, 0, sizeof(*buffer));
+}
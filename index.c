@@ -0,0 +1,288 @@
+#include "png.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <sys/mman.h>
+
+static int png_index_read(struct png_index *index, int fd) {
+    unsigned char *buffer = NULL, *temp;
+    size_t capacity = 0, size = 0;
+    ssize_t got;
+
+    for (;;) {
+        if (size == capacity) {
+            capacity = capacity ? capacity * 2 : 1 << 20;
+            temp = (unsigned char *) png_realloc(buffer, capacity);
+            if (NULL == temp) {
+                free(buffer);
+                return PNG_ERR_NOMEM;
+            }
+            buffer = temp;
+        }
+        got = read(fd, buffer + size, capacity - size);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got < 0) {
+            free(buffer);
+            return PNG_ERR_IO;
+        }
+        if (got == 0) {
+            break;
+        }
+        size += got;
+    }
+
+    index->base = buffer;
+    index->size = size;
+    index->mapped = 0;
+    index->owned = 1;
+
+    return PNG_OK;
+}
+
+int png_index_open(struct png_index *index, const char *path) {
+    struct stat st;
+    void *map;
+    int fd, err = PNG_OK;
+
+    png_index_close(index);
+
+    if ((fd = open(path, O_RDONLY | O_BINARY)) == -1) {
+        return PNG_ERR_IO;
+    }
+
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 &&
+        (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) != MAP_FAILED) {
+        madvise(map, st.st_size, MADV_SEQUENTIAL);
+        index->base = (const unsigned char *) map;
+        index->size = st.st_size;
+        index->mapped = 1;
+        index->owned = 1;
+    } else {
+        err = png_index_read(index, fd);
+    }
+
+    close(fd);
+    return err;
+}
+
+void png_index_attach(struct png_index *index, const unsigned char *data, size_t size) {
+    png_index_close(index);
+    index->base = data;
+    index->size = size;
+}
+
+void png_index_close(struct png_index *index) {
+    if (index->owned && index->mapped) {
+        munmap((void *) index->base, index->size);
+    } else if (index->owned) {
+        free((void *) index->base);
+    }
+    index->base = NULL;
+    index->size = 0;
+    index->mapped = 0;
+    index->owned = 0;
+    index->inflated = 0;
+    index->count = 0;
+}
+
+void png_index_free(struct png_index *index) {
+    png_index_close(index);
+    free(index->chunks);
+    memset(index, 0, sizeof(*index));
+}
+
+int png_index_parse(struct png_index *index) {
+    const unsigned char *base = index->base;
+    struct png_chunk_desc *desc, *temp;
+    size_t offset = 8;
+    uint32_t len, checksum;
+
+    index->count = 0;
+
+    if (index->size < 8 || !png_validate_signature(base)) {
+        return PNG_ERR_SIGNATURE;
+    }
+
+    do {
+        if (index->size - offset < 12) {
+            return PNG_ERR_TRUNCATED;
+        }
+
+        memcpy(&len, base + offset, 4);
+        len = byteswap_ulong(len);
+
+        if (index->size - offset - 12 < len) {
+            return PNG_ERR_TRUNCATED;
+        }
+
+        if (index->count == index->capacity) {
+            index->capacity = index->capacity ? index->capacity * 2 : 32;
+            temp = (struct png_chunk_desc *) png_realloc(index->chunks, index->capacity * sizeof(*index->chunks));
+            if (NULL == temp) {
+                return PNG_ERR_NOMEM;
+            }
+            index->chunks = temp;
+        }
+
+        desc = &index->chunks[index->count++];
+        desc->offset = offset;
+        desc->len = len;
+        desc->data = base + offset + 8;
+        memcpy(desc->type, base + offset + 4, 4);
+
+        checksum = byteswap_ulong(png_crc32(0, base + offset + 4, len + 4));
+        desc->crc_ok = !memcmp(&checksum, base + offset + 8 + len, 4);
+
+        offset += 12 + (size_t) len;
+    } while (memcmp(desc->type, "IEND", 4) != 0);
+
+    if (memcmp(index->chunks[0].type, "IHDR", 4) != 0 || index->chunks[0].len != 13) {
+        return PNG_ERR_IHDR;
+    }
+
+    index->idat_first = index->idat_last = index->count;
+    for (size_t i = 0; i < index->count; i++) {
+        if (!index->chunks[i].crc_ok) {
+            return PNG_ERR_CRC;
+        }
+        if (!memcmp(index->chunks[i].type, "IDAT", 4)) {
+            if (index->idat_first == index->count) {
+                index->idat_first = i;
+            }
+            index->idat_last = i + 1;
+        }
+    }
+
+    if (index->idat_first == index->count) {
+        return PNG_ERR_NO_IDAT;
+    }
+
+    return PNG_OK;
+}
+
+void png_index_stats(const struct png_index *index, struct png_stats *stats) {
+    memcpy(stats, index->chunks[0].data, sizeof(*stats));
+    stats->width = byteswap_ulong(stats->width);
+    stats->height = byteswap_ulong(stats->height);
+}
+
+static int png_index_inflate(z_stream *strm, const unsigned char *data, uint32_t len, struct png_buffer *out, int *ret) {
+    size_t room;
+
+    strm->next_in = (unsigned char *) data;
+    strm->avail_in = len;
+
+    do {
+        if (out->len == out->capacity && !png_buffer_reserve(out, out->capacity + 1)) {
+            return PNG_ERR_NOMEM;
+        }
+
+        room = out->capacity - out->len;
+        strm->next_out = out->data + out->len;
+        strm->avail_out = room > UINT_MAX ? UINT_MAX : room;
+
+        *ret = inflate(strm, Z_NO_FLUSH);
+        switch (*ret) {
+            case Z_NEED_DICT:
+            case Z_STREAM_ERROR:
+            case Z_DATA_ERROR:
+                return PNG_ERR_ZLIB;
+            case Z_MEM_ERROR:
+                return PNG_ERR_NOMEM;
+            default:
+                break;
+        }
+
+        out->len = (size_t) (strm->next_out - out->data);
+    } while (strm->avail_out == 0 && *ret != Z_STREAM_END);
+
+    return PNG_OK;
+}
+
+int png_index_decompress(struct png_ctx *ctx, const struct png_index *index, struct png_buffer *out) {
+    size_t i;
+    int ret = Z_OK, err;
+
+    out->len = 0;
+    inflateReset(&ctx->inflate_strm);
+
+    for (i = index->idat_first; i < index->idat_last && ret != Z_STREAM_END; i++) {
+        if (memcmp(index->chunks[i].type, "IDAT", 4) != 0) {
+            continue;
+        }
+        if (PNG_OK != (err = png_index_inflate(&ctx->inflate_strm, index->chunks[i].data, index->chunks[i].len, out, &ret))) {
+            return err;
+        }
+    }
+
+    return PNG_OK;
+}
+
+int png_index_receive(struct png_ctx *ctx, struct png_index *index, int fd) {
+    unsigned char *buffer = NULL, *temp;
+    size_t capacity = 0, size = 0, offset = 8;
+    _Bool png = 1, done = 0;
+    int ret = Z_OK, err = PNG_OK;
+    uint32_t len;
+    ssize_t got;
+
+    png_index_close(index);
+    ctx->inflated.len = 0;
+    inflateReset(&ctx->inflate_strm);
+
+    /* after a zlib error keep reading to EOF, the buffered path then reports it */
+    while (!done) {
+        if (size == capacity) {
+            capacity = capacity ? capacity * 2 : 1 << 20;
+            temp = (unsigned char *) png_realloc(buffer, capacity);
+            if (NULL == temp) {
+                free(buffer);
+                return PNG_ERR_NOMEM;
+            }
+            buffer = temp;
+        }
+
+        got = read(fd, buffer + size, capacity - size);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got < 0) {
+            free(buffer);
+            return PNG_ERR_IO;
+        }
+        if (got == 0) {
+            break;
+        }
+        size += got;
+
+        if (png && size >= 8 && !png_validate_signature(buffer)) {
+            png = 0;
+        }
+
+        while (png && PNG_OK == err && size >= 8 && size - offset >= 12) {
+            memcpy(&len, buffer + offset, 4);
+            len = byteswap_ulong(len);
+            if (size - offset - 12 < len) {
+                break;
+            }
+
+            if (!memcmp(buffer + offset + 4, "IDAT", 4) && ret != Z_STREAM_END) {
+                err = png_index_inflate(&ctx->inflate_strm, buffer + offset + 8, len, &ctx->inflated, &ret);
+            } else if (!memcmp(buffer + offset + 4, "IEND", 4)) {
+                done = 1;
+                break;
+            }
+            offset += 12 + (size_t) len;
+        }
+    }
+
+    index->base = buffer;
+    index->size = size;
+    index->mapped = 0;
+    index->owned = 1;
+    index->inflated = done && PNG_OK == err && Z_STREAM_END == ret;
+
+    return PNG_OK;
+}
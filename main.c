@@ -1,86 +1,299 @@
 #include "png.h"
 
-int main(int argc, char *argv[]) {
+#include <getopt.h>
+#include <time.h>
 
-    if (argc != 3) {
-        printf("Usage: %s [INPUT] [OUTPUT]\n", argv[0]);
-        exit(1);
-    }
+static void usage(const char *name) {
+    printf("Usage: %s [INPUT|-] [OUTPUT|-]\n", name);
+    printf("       %s --batch [--jobs N] [OUTDIR] [DIR|GLOB|MANIFEST]...\n", name);
+    printf("       %s --serve SOCKET|- [--jobs N] [--max-inflight N]\n", name);
+    printf("       %s --variants LIST [--jobs N] [INPUT] [OUTPUT-TEMPLATE]\n", name);
+    printf("       %s --sequence WxH:FORMAT [--jobs N] [OUTPUT-TEMPLATE|-] < FRAMES\n", name);
+    puts("\nOptions:\n"
+         "  --stream              process the image a few scanlines at a time with bounded memory\n"
+         "  --pipeline            like --stream, but inflate, refilter, deflate and write run on their own threads\n"
+         "                        (--cache, --deflate-threads, --filter-threads, --race and --preview use the buffered path)\n"
+         "  --deflate-threads N   compress the image data in parallel blocks on N threads\n"
+         "  --filter-threads N    refilter bands of rows in parallel on N threads\n"
+         "  --block-size KIB      size of the parallel deflate blocks (default 128)\n"
+         "  --mmap-output         write the result into a pre-sized memory mapping instead of with writev\n"
+         "  --preview             compress with a fast built-in encoder (run-length and fixed Huffman codes) for quick,\n"
+         "                        larger drafts instead of zlib\n"
+         "  --filter F            refilter with none, sub, up, avg or paeth (default), or pick per row with msad or entropy\n"
+         "  --race[=MS]           compress with several zlib settings at once and keep the smallest, giving up\n"
+         "                        on all but the default after MS milliseconds\n"
+         "  --raw WxH:FORMAT      read the input as bare gray, graya, rgb or rgba pixels (add 16 for 16-bit samples);\n"
+         "                        PNM and PAM inputs are recognised without it\n"
+         "  --effects SPEC        seeded per-row effects applied while refiltering, e.g. seed=7,swap=0.1,shift=0.05:64,\n"
+         "                        drift=0.02:8,rotate=0.1,bpp=0.05; corrupt=P flips that share of compressed bytes\n"
+         "  --progressive         write interlaced inputs out de-interlaced instead of refiltering each Adam7 pass\n"
+         "  --cache DIR           keep unfiltered images in DIR so later runs on the same source skip inflate and unfilter\n"
+         "  --cache-size MIB      evict the least recently used cache entries beyond MIB (default 1024)\n"
+         "  --variants LIST       decode once and write one output per FILTER[:BPP[:LEVEL]] in LIST (comma separated,\n"
+         "                        'all' for the five fixed filters); {filter}, {bpp}, {level} and {n} in OUTPUT are expanded\n"
+         "  --sequence WxH:FORMAT glitch raw frames of that layout from stdin and write them to stdout, or to one PNG\n"
+         "                        per frame with {n} in OUTPUT expanded to the frame number\n"
+         "  --max-inflight N      in serve mode, stop reading requests while N jobs are queued or running\n"
+         "  --stats=json          print one JSON line of per-stage timings and allocation counts per image to stderr\n"
+         "  --selftest            check the accelerated CRC-32 engines against the reference table");
+}
 
-    uint32_t *crc_tbl = mk_crc_tbl();
+static size_t parse_variants(char *list, struct png_variant *variants, size_t capacity) {
+    char *item, *field, *save = NULL;
+    size_t count = 0;
+    int policy;
 
-    int fd;
-    if ((fd = open(argv[1], O_RDONLY | O_BINARY)) == -1) {
-        printf("Failed to open file '%s'\n", argv[1]);
-        exit(1);
-    }
+    for (item = strtok_r(list, ",", &save); NULL != item; item = strtok_r(NULL, ",", &save)) {
+        if (!strcmp(item, "all")) {
+            for (policy = PNG_FILTER_NONE; policy <= PNG_FILTER_PAETH && count < capacity; policy++) {
+                variants[count].filter_method = (unsigned char) policy;
+                variants[count].bpp = 0;
+                variants[count].level = -1;
+                count++;
+            }
+            continue;
+        }
 
-    size_t file_size = lseek(fd, 0L, SEEK_END);
-    lseek(fd, 0L, SEEK_SET);
+        if (count == capacity) {
+            fprintf(stderr, "Too many variants, at most %zu\n", capacity);
+            exit(1);
+        }
 
-    unsigned char *picture = (unsigned char *) calloc(file_size, sizeof(*picture));
-    CHALLOC(picture)
+        field = strchr(item, ':');
+        if (NULL != field) {
+            *field++ = '\0';
+        }
+        if ((policy = png_filter_policy(item)) < 0) {
+            fprintf(stderr, "Unknown filter '%s'\n", item);
+            exit(1);
+        }
 
-    if (read(fd, picture, file_size) == -1) {
-        printf("Failed to read file '%s'\n", argv[1]);
-        close(fd);
-        exit(1);
-    }
-    close(fd);
+        variants[count].filter_method = (unsigned char) policy;
+        variants[count].bpp = 0;
+        variants[count].level = -1;
 
-    if (!png_validate_signature(picture)) {
-        fputs("The image does not have a valid png signature, aborting!\n", stderr);
-        exit(1);
+        if (NULL != field) {
+            variants[count].bpp = (unsigned char) strtoul(field, &field, 10);
+            if (*field == ':') {
+                variants[count].level = field[1] ? (int) strtol(field + 1, NULL, 10) : -1;
+            }
+        }
+        count++;
     }
 
-    struct png *start = png_extract_chunks(picture, crc_tbl);
-    free(picture);
+    return count;
+}
 
-    if (!png_validate_hdr(start->chunk_hdr, (const unsigned char *) "IHDR")) {
-        fputs("IHDR chunk is not the first chunk of the image, aborting!", stderr);
-        exit(1);
-    }
+int main(int argc, char *argv[]) {
 
-    struct png_stats *image_info = png_extract_stats(start->chunk_data);
-    png_validate_ihdr(image_info);
+    static const struct option options[] = {
+            {"batch",  no_argument,       NULL, 'b'},
+            {"jobs",   required_argument, NULL, 'j'},
+            {"stream", no_argument,       NULL, 's'},
+            {"pipeline", no_argument,     NULL, 'p'},
+            {"deflate-threads", required_argument, NULL, 'z'},
+            {"filter-threads", required_argument, NULL, 'F'},
+            {"block-size", required_argument, NULL, 'B'},
+            {"mmap-output", no_argument, NULL, 'M'},
+            {"preview", no_argument,      NULL, 'v'},
+            {"filter", required_argument, NULL, 'f'},
+            {"race", optional_argument,   NULL, 'R'},
+            {"progressive", no_argument,  NULL, 'P'},
+            {"raw", required_argument,    NULL, 'W'},
+            {"effects", required_argument, NULL, 'E'},
+            {"cache", required_argument,  NULL, 'C'},
+            {"cache-size", required_argument, NULL, 'L'},
+            {"variants", required_argument, NULL, 'V'},
+            {"sequence", required_argument, NULL, 'q'},
+            {"stats", required_argument,  NULL, 'S'},
+            {"serve", required_argument,  NULL, 'D'},
+            {"max-inflight", required_argument, NULL, 'Q'},
+            {"selftest", no_argument,     NULL, 'T'},
+            {"help",   no_argument,       NULL, 'h'},
+            {NULL, 0,                     NULL, 0}
+    };
 
-    unsigned char *compressed_buffer;
-    size_t compressed_size = png_extract_data(start, &compressed_buffer);
+    struct png_opts opts;
+    _Bool batch = 0;
+    const char *serve = NULL;
+    const char *sequence = NULL;
+    long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    long max_inflight = 0;
+    struct png_variant variants[256];
+    size_t variant_count = 0;
+    int opt;
 
-    unsigned char *decompressed_buffer;
-    size_t decompressed_size = png_zlib_decompress(compressed_buffer, compressed_size, &decompressed_buffer);
-    free(compressed_buffer);
+    png_opts_init(&opts);
+    while ((opt = getopt_long(argc, argv, "bj:spz:F:B:f:MvPW:E:C:L:V:q:S:TD:Q:h", options, NULL)) != -1) {
+        switch (opt) {
+            case 'b':
+                batch = 1;
+                break;
+            case 'j':
+                jobs = strtol(optarg, NULL, 10);
+                break;
+            case 's':
+                opts.stream = 1;
+                break;
+            case 'p':
+                opts.pipeline = 1;
+                break;
+            case 'z':
+                opts.deflate_threads = strtoul(optarg, NULL, 10);
+                break;
+            case 'F':
+                opts.filter_threads = strtoul(optarg, NULL, 10);
+                break;
+            case 'B':
+                opts.block_size = strtoul(optarg, NULL, 10) << 10;
+                break;
+            case 'D':
+                serve = optarg;
+                break;
+            case 'Q':
+                max_inflight = strtol(optarg, NULL, 10);
+                break;
+            case 'f': {
+                int policy = png_filter_policy(optarg);
+                if (policy < 0) {
+                    fprintf(stderr, "Unknown filter '%s'\n", optarg);
+                    exit(1);
+                }
+                opts.filter_method = (unsigned char) policy;
+                break;
+            }
+            case 'R':
+                opts.race = 1;
+                opts.race_budget_ms = optarg ? strtoul(optarg, NULL, 10) : 0;
+                break;
+            case 'M':
+                opts.mmap_output = 1;
+                break;
+            case 'v':
+                opts.preview = 1;
+                break;
+            case 'P':
+                opts.progressive = 1;
+                break;
+            case 'W':
+                opts.raw_format = optarg;
+                break;
+            case 'E':
+                opts.effects = optarg;
+                break;
+            case 'C':
+                opts.cache_dir = optarg;
+                break;
+            case 'L':
+                opts.cache_size = (size_t) strtoull(optarg, NULL, 10) << 20;
+                break;
+            case 'V':
+                variant_count = parse_variants(optarg, variants, sizeof(variants) / sizeof(*variants));
+                break;
+            case 'q':
+                sequence = optarg;
+                break;
+            case 'S':
+                if (strcmp(optarg, "json") != 0) {
+                    fprintf(stderr, "Unknown stats format '%s'\n", optarg);
+                    exit(1);
+                }
+                opts.stats_json = 1;
+                break;
+            case 'T': {
+                uint32_t *crc_tbl = mk_crc_tbl();
+                CHALLOC(crc_tbl)
+                _Bool ok = png_crc32_selftest(crc_tbl);
+                printf("crc32 engine %s: %s\n", png_crc32_engine(), ok ? "ok" : "FAILED");
+                free(crc_tbl);
+                return !ok;
+            }
+            default:
+                usage(argv[0]);
+                exit(1);
+        }
+    }
 
-    size_t reconstructed_size = decompressed_size - image_info->height;
-    unsigned char *reconstructed_image = png_reconstruct_image(decompressed_buffer, reconstructed_size, image_info);
-    free(decompressed_buffer);
+    if (serve) {
+        if (jobs <= 0) {
+            jobs = 1;
+        }
+        if (max_inflight <= 0) {
+            max_inflight = jobs * 4;
+        }
+        return png_serve(serve, (unsigned int) jobs, (unsigned int) max_inflight, &opts);
+    }
 
-    unsigned char *filtered_ = png_filter_image_fixed(reconstructed_image, reconstructed_size, image_info, 4);
-    unsigned char *compressed;
+    if (sequence) {
+        struct timespec begin, end;
+        size_t frames = 0;
+        double seconds;
 
-    compressed_size = png_zlib_compress(filtered_, image_info->height + reconstructed_size, &compressed);
+        if (argc - optind > 1) {
+            usage(argv[0]);
+            exit(1);
+        }
 
-    image_info->width = byteswap_ulong(image_info->width);
-    image_info->height = byteswap_ulong(image_info->height);
+        clock_gettime(CLOCK_MONOTONIC, &begin);
+        int err = png_glitch_sequence(sequence, STDIN_FILENO, STDOUT_FILENO, argc > optind ? argv[optind] : NULL,
+                                      jobs > 0 ? (unsigned int) jobs : 1, &opts, &frames);
+        clock_gettime(CLOCK_MONOTONIC, &end);
 
-    struct png *idat = png_inject_data(compressed, compressed_size, 1 << 16);
+        seconds = (double) (end.tv_sec - begin.tv_sec) + (double) (end.tv_nsec - begin.tv_nsec) / 1e9;
+        fprintf(stderr, "%zu frames in %.3f s (%.1f fps)\n", frames, seconds, seconds > 0 ? frames / seconds : 0.0);
+        if (PNG_OK != err) {
+            fprintf(stderr, "Failed to glitch the frame sequence: %s\n", png_strerror(err));
+            exit(1);
+        }
+        return 0;
+    }
 
-    file_size = png_recycle_chunks(start, idat);
-    picture = png_flatten_image(start, file_size, crc_tbl);
+    if (batch) {
+        if (argc - optind < 2) {
+            usage(argv[0]);
+            exit(1);
+        }
+        return png_batch(argv + optind + 1, argc - optind - 1, argv[optind], jobs > 0 ? (unsigned int) jobs : 1, &opts);
+    }
 
-    if ((fd = open(argv[2], O_CREAT | O_TRUNC | O_WRONLY | O_BINARY, S_IREAD | S_IWRITE)) == -1) {
-        fprintf(stderr, "Failed to open file '%s'\n", argv[2]);
+    if (argc - optind != 2) {
+        usage(argv[0]);
         exit(1);
     }
 
-    if (write(fd, picture, file_size) == -1) {
-        fprintf(stderr, "Failed to open file '%s'\n", argv[2]);
-        close(fd);
+    struct png_ctx *ctx = png_ctx_create();
+    CHALLOC(ctx)
+
+    if (variant_count) {
+        struct timespec begin, end;
+        clock_gettime(CLOCK_MONOTONIC, &begin);
+
+        int err = png_glitch_fanout(ctx, argv[optind], argv[optind + 1], variants, variant_count,
+                                    jobs > 0 ? (unsigned int) jobs : 1, &opts);
+        png_ctx_destroy(ctx);
+        if (PNG_OK != err) {
+            fprintf(stderr, "Failed to glitch '%s': %s\n", argv[optind], png_strerror(err));
+            exit(1);
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        fprintf(stderr, "%zu variants of '%s' in %.3f s\n", variant_count, argv[optind],
+                (double) (end.tv_sec - begin.tv_sec) + (double) (end.tv_nsec - begin.tv_nsec) / 1e9);
+        return 0;
+    }
+
+    int err = png_glitch_file(ctx, argv[optind], argv[optind + 1], &opts);
+    if (PNG_OK != err) {
+        fprintf(stderr, "Failed to glitch '%s': %s\n", argv[optind], png_strerror(err));
+        png_ctx_destroy(ctx);
         exit(1);
     }
-    close(fd);
 
-    free(crc_tbl);
+    if (opts.race && !opts.stats_json && NULL != png_ctx_deflate_config(ctx)) {
+        fprintf(stderr, "Smallest IDAT from zlib %s\n", png_ctx_deflate_config(ctx));
+    }
+
+    png_ctx_destroy(ctx);
 
     return 0;
 }
@@ -0,0 +1,180 @@
+#include "png.h"
+
+#include <pthread.h>
+
+#define PNG_DICT_SIZE 32768
+
+struct png_pdeflate_block {
+    size_t start;
+    size_t len;
+    unsigned char *out;
+    size_t bound;
+    size_t out_len;
+    uLong adler;
+};
+
+struct png_pdeflate {
+    const unsigned char *input;
+    struct png_pdeflate_block *blocks;
+    size_t count;
+    int level;
+
+    pthread_mutex_t lock;
+    size_t next;
+    int error;
+};
+
+static void *png_pdeflate_worker(void *arg) {
+    struct png_pdeflate *job = (struct png_pdeflate *) arg;
+    struct png_pdeflate_block *block;
+    size_t index, dict_len;
+    z_stream stream;
+    int ret, flush;
+
+    stream.zalloc = Z_NULL;
+    stream.zfree = Z_NULL;
+    stream.opaque = Z_NULL;
+    if (Z_OK != deflateInit2(&stream, job->level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY)) {
+        pthread_mutex_lock(&job->lock);
+        job->error = Z_MEM_ERROR;
+        pthread_mutex_unlock(&job->lock);
+        return NULL;
+    }
+
+    for (;;) {
+        pthread_mutex_lock(&job->lock);
+        index = job->next++;
+        pthread_mutex_unlock(&job->lock);
+
+        if (index >= job->count) {
+            break;
+        }
+
+        block = &job->blocks[index];
+        flush = index + 1 == job->count ? Z_FINISH : Z_SYNC_FLUSH;
+
+        deflateReset(&stream);
+        if (block->start > 0) {
+            dict_len = block->start < PNG_DICT_SIZE ? block->start : PNG_DICT_SIZE;
+            deflateSetDictionary(&stream, job->input + block->start - dict_len, dict_len);
+        }
+
+        block->adler = adler32(1L, job->input + block->start, block->len);
+
+        stream.next_in = (unsigned char *) job->input + block->start;
+        stream.avail_in = block->len;
+        stream.next_out = block->out;
+        stream.avail_out = block->bound;
+
+        for (;;) {
+            ret = deflate(&stream, flush);
+            if (Z_STREAM_ERROR == ret || stream.avail_out == 0) {
+                pthread_mutex_lock(&job->lock);
+                job->error = Z_STREAM_ERROR;
+                pthread_mutex_unlock(&job->lock);
+                break;
+            }
+            if (stream.avail_in == 0 && (flush != Z_FINISH || ret == Z_STREAM_END)) {
+                break;
+            }
+        }
+
+        block->out_len = block->bound - stream.avail_out;
+    }
+
+    deflateEnd(&stream);
+    return NULL;
+}
+
+int png_zlib_compress_parallel(struct png_arena *arena, const unsigned char *uncompressed, size_t strm_len,
+                               struct png_buffer *out, unsigned int threads, size_t block_size) {
+
+    struct png_pdeflate job;
+    pthread_t *workers;
+    unsigned char *tmp;
+    size_t i, started, total;
+    uLong adler;
+    uint32_t trailer;
+
+    if (block_size < PNG_DICT_SIZE) {
+        block_size = PNG_DICT_SIZE;
+    }
+
+    memset(&job, 0, sizeof(job));
+    job.input = uncompressed;
+    job.level = Z_DEFAULT_COMPRESSION;
+    job.count = strm_len ? (strm_len + block_size - 1) / block_size : 1;
+    pthread_mutex_init(&job.lock, NULL);
+
+    job.blocks = (struct png_pdeflate_block *) png_arena_calloc(arena, job.count * sizeof(*job.blocks));
+    if (NULL == job.blocks) {
+        pthread_mutex_destroy(&job.lock);
+        return PNG_ERR_NOMEM;
+    }
+
+    for (i = 0; i < job.count; i++) {
+        job.blocks[i].start = i * block_size;
+        job.blocks[i].len = i + 1 == job.count ? strm_len - job.blocks[i].start : block_size;
+        job.blocks[i].bound = compressBound(job.blocks[i].len) + 16;
+        if (NULL == (job.blocks[i].out = (unsigned char *) png_arena_alloc(arena, job.blocks[i].bound))) {
+            pthread_mutex_destroy(&job.lock);
+            return PNG_ERR_NOMEM;
+        }
+    }
+
+    if (threads == 0) {
+        threads = 1;
+    }
+    if (threads > job.count) {
+        threads = job.count;
+    }
+
+    workers = (pthread_t *) png_arena_alloc(arena, threads * sizeof(*workers));
+    if (NULL == workers) {
+        threads = 1;
+    }
+
+    for (started = 1; started < threads; started++) {
+        if (pthread_create(&workers[started], NULL, png_pdeflate_worker, &job) != 0) {
+            break;
+        }
+    }
+    png_pdeflate_worker(&job);
+    for (i = 1; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+
+    if (job.error) {
+        pthread_mutex_destroy(&job.lock);
+        return job.error == Z_MEM_ERROR ? PNG_ERR_NOMEM : PNG_ERR_ZLIB;
+    }
+
+    total = 2 + 4;
+    for (i = 0; i < job.count; i++) {
+        total += job.blocks[i].out_len;
+    }
+
+    if (!png_buffer_reserve(out, total)) {
+        pthread_mutex_destroy(&job.lock);
+        return PNG_ERR_NOMEM;
+    }
+
+    tmp = out->data;
+    *tmp++ = 0x78;
+    *tmp++ = 0x9c;
+
+    adler = 1L;
+    for (i = 0; i < job.count; i++) {
+        memcpy(tmp, job.blocks[i].out, job.blocks[i].out_len);
+        tmp += job.blocks[i].out_len;
+        adler = i ? adler32_combine(adler, job.blocks[i].adler, (z_off_t) job.blocks[i].len) : job.blocks[i].adler;
+    }
+
+    trailer = byteswap_ulong((uint32_t) adler);
+    memcpy(tmp, &trailer, 4);
+    out->len = total;
+
+    pthread_mutex_destroy(&job.lock);
+
+    return PNG_OK;
+}
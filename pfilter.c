@@ -0,0 +1,134 @@
+#include "png.h"
+
+#include <pthread.h>
+
+#define PNG_FILTER_BAND (256 << 10)
+
+struct png_pfilter {
+    const unsigned char *unfiltered;
+    const unsigned char *zero;
+    const struct png_effects *effects;
+    unsigned char *filtered;
+    size_t stride;
+    uint32_t height;
+    uint32_t band_rows;
+    size_t count;
+    unsigned char bpp;
+    unsigned char filter_method;
+
+    pthread_mutex_t lock;
+    size_t next;
+};
+
+struct png_pfilter_worker {
+    struct png_pfilter *job;
+    unsigned char *candidates;
+    pthread_t thread;
+};
+
+static void *png_pfilter_worker(void *arg) {
+    struct png_pfilter_worker *worker = (struct png_pfilter_worker *) arg;
+    struct png_pfilter *job = worker->job;
+    png_filter_fn kernel = job->filter_method > PNG_FILTER_PAETH ? NULL : png_filter_kernel(job->filter_method, job->bpp);
+    const unsigned char *unfiltered, *prev;
+    unsigned char *filtered;
+    uint32_t h, end;
+    size_t index;
+
+    for (;;) {
+        pthread_mutex_lock(&job->lock);
+        index = job->next++;
+        pthread_mutex_unlock(&job->lock);
+
+        if (index >= job->count) {
+            break;
+        }
+
+        h = (uint32_t) index * job->band_rows;
+        end = job->height - h < job->band_rows ? job->height : h + job->band_rows;
+        unfiltered = job->unfiltered + h * job->stride;
+        filtered = job->filtered + h * (job->stride + 1);
+        prev = h ? unfiltered - job->stride : job->zero;
+
+        for (; h < end; h++) {
+            if (NULL != job->effects) {
+                png_effects_row(job->effects, h, filtered, unfiltered, prev, job->stride, job->bpp, job->filter_method,
+                                worker->candidates);
+            } else if (NULL == kernel) {
+                png_filter_row_adaptive(filtered, unfiltered, prev, job->stride, job->bpp, job->filter_method,
+                                        worker->candidates);
+            } else {
+                filtered[0] = job->filter_method;
+                kernel(filtered + 1, unfiltered, prev, job->stride, job->bpp);
+            }
+
+            prev = unfiltered;
+            unfiltered += job->stride;
+            filtered += job->stride + 1;
+        }
+    }
+
+    return NULL;
+}
+
+int png_filter_image_parallel(struct png_ctx *ctx, const unsigned char *restrict unfiltered, size_t unfiltered_size,
+                              const struct png_stats *restrict stats, unsigned char filter_method,
+                              struct png_buffer *out, unsigned int threads) {
+
+    struct png_pfilter job;
+    struct png_pfilter_worker *workers;
+    size_t i, started;
+
+    if (filter_method > PNG_FILTER_ENTROPY) {
+        return PNG_ERR_ARG;
+    }
+
+    memset(&job, 0, sizeof(job));
+    job.unfiltered = unfiltered;
+    job.stride = unfiltered_size / stats->height;
+    job.height = stats->height;
+    job.bpp = stats->bit_depth;
+    job.filter_method = filter_method;
+    job.effects = ctx->effects.active ? &ctx->effects : NULL;
+    job.band_rows = PNG_FILTER_BAND / (job.stride + 1) ? PNG_FILTER_BAND / (job.stride + 1) : 1;
+    job.count = (job.height + job.band_rows - 1) / job.band_rows;
+
+    if (threads == 0) {
+        threads = 1;
+    }
+    if (threads > job.count) {
+        threads = job.count;
+    }
+
+    if (!png_buffer_reserve(out, unfiltered_size + stats->height) ||
+        NULL == (job.zero = png_buffer_zero(&ctx->zero, job.stride)) ||
+        NULL == (workers = (struct png_pfilter_worker *) png_arena_calloc(&ctx->arena, threads * sizeof(*workers)))) {
+        return PNG_ERR_NOMEM;
+    }
+    job.filtered = out->data;
+
+    for (i = 0; i < threads; i++) {
+        workers[i].job = &job;
+        if ((filter_method > PNG_FILTER_PAETH || NULL != job.effects) &&
+            NULL == (workers[i].candidates = (unsigned char *) png_arena_alloc(&ctx->arena, 5 * job.stride))) {
+            return PNG_ERR_NOMEM;
+        }
+    }
+
+    pthread_mutex_init(&job.lock, NULL);
+
+    for (started = 1; started < threads; started++) {
+        if (pthread_create(&workers[started].thread, NULL, png_pfilter_worker, &workers[started]) != 0) {
+            break;
+        }
+    }
+    png_pfilter_worker(&workers[0]);
+    for (i = 1; i < started; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+
+    pthread_mutex_destroy(&job.lock);
+
+    out->len = unfiltered_size + stats->height;
+    return PNG_OK;
+}
@@ -0,0 +1,332 @@
+#include "png.h"
+
+#include <pthread.h>
+#include <sched.h>
+
+#define PNG_PIPELINE_SLOTS 4
+#define PNG_PIPELINE_BAND (256 << 10)
+#define PNG_PIPELINE_IDAT (1 << 16)
+
+struct png_ring {
+    unsigned char *data;
+    size_t slot_size;
+    size_t lens[PNG_PIPELINE_SLOTS];
+    _Bool last[PNG_PIPELINE_SLOTS];
+    size_t head;
+    size_t tail;
+};
+
+struct png_pipeline {
+    struct png_ctx *ctx;
+    const struct png_index *index;
+    const struct png_stats *stats;
+    unsigned char filter_method;
+    size_t stride;
+    size_t band_rows;
+
+    struct png_ring inflated;
+    struct png_ring filtered;
+    struct png_ring compressed;
+
+    unsigned char *prev;
+    unsigned char *scratch;
+    size_t filter_hist[5];
+    int err;
+};
+
+static void png_pipeline_fail(struct png_pipeline *pipe, int err) {
+    int expected = PNG_OK;
+    __atomic_compare_exchange_n(&pipe->err, &expected, err, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+static _Bool png_pipeline_wait(struct png_pipeline *pipe, const size_t *counter, size_t until) {
+    unsigned int spins;
+
+    for (spins = 0; __atomic_load_n(counter, __ATOMIC_ACQUIRE) < until; spins++) {
+        if (PNG_OK != __atomic_load_n(&pipe->err, __ATOMIC_ACQUIRE)) {
+            return 0;
+        }
+        if (spins > 64) {
+            sched_yield();
+        }
+    }
+
+    return 1;
+}
+
+static unsigned char *png_ring_acquire(struct png_pipeline *pipe, struct png_ring *ring) {
+    if (ring->head >= PNG_PIPELINE_SLOTS && !png_pipeline_wait(pipe, &ring->tail, ring->head - PNG_PIPELINE_SLOTS + 1)) {
+        return NULL;
+    }
+    return ring->data + (ring->head % PNG_PIPELINE_SLOTS) * ring->slot_size;
+}
+
+static void png_ring_publish(struct png_ring *ring, size_t len, _Bool last) {
+    ring->lens[ring->head % PNG_PIPELINE_SLOTS] = len;
+    ring->last[ring->head % PNG_PIPELINE_SLOTS] = last;
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+static unsigned char *png_ring_peek(struct png_pipeline *pipe, struct png_ring *ring, size_t *len, _Bool *last) {
+    if (!png_pipeline_wait(pipe, &ring->head, ring->tail + 1)) {
+        return NULL;
+    }
+    *len = ring->lens[ring->tail % PNG_PIPELINE_SLOTS];
+    *last = ring->last[ring->tail % PNG_PIPELINE_SLOTS];
+    return ring->data + (ring->tail % PNG_PIPELINE_SLOTS) * ring->slot_size;
+}
+
+static void png_ring_release(struct png_ring *ring) {
+    __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+}
+
+static void *png_pipeline_inflate(void *arg) {
+    struct png_pipeline *pipe = (struct png_pipeline *) arg;
+    const struct png_index *index = pipe->index;
+    z_stream *strm = &pipe->ctx->inflate_strm;
+    size_t row_len = pipe->stride + 1, chunk = index->idat_first, left = pipe->stats->height, want, filled;
+    unsigned char *band;
+    int ret = Z_OK;
+
+    inflateReset(strm);
+    strm->avail_in = 0;
+
+    while (left > 0 && ret != Z_STREAM_END) {
+        if (NULL == (band = png_ring_acquire(pipe, &pipe->inflated))) {
+            return NULL;
+        }
+
+        want = (left < pipe->band_rows ? left : pipe->band_rows) * row_len;
+        strm->next_out = band;
+        strm->avail_out = want;
+
+        while (strm->avail_out > 0 && ret != Z_STREAM_END) {
+            if (strm->avail_in == 0) {
+                while (chunk < index->idat_last && memcmp(index->chunks[chunk].type, "IDAT", 4) != 0) {
+                    chunk++;
+                }
+                if (chunk == index->idat_last) {
+                    break;
+                }
+                strm->next_in = (unsigned char *) index->chunks[chunk].data;
+                strm->avail_in = index->chunks[chunk].len;
+                chunk++;
+            }
+
+            ret = inflate(strm, Z_NO_FLUSH);
+            if (Z_NEED_DICT == ret || Z_STREAM_ERROR == ret || Z_DATA_ERROR == ret) {
+                png_pipeline_fail(pipe, PNG_ERR_ZLIB);
+                return NULL;
+            }
+            if (Z_MEM_ERROR == ret) {
+                png_pipeline_fail(pipe, PNG_ERR_NOMEM);
+                return NULL;
+            }
+        }
+
+        filled = want - strm->avail_out;
+        if (filled < want) {
+            png_pipeline_fail(pipe, PNG_ERR_TRUNCATED);
+            return NULL;
+        }
+
+        left -= filled / row_len;
+        png_ring_publish(&pipe->inflated, filled, left == 0);
+    }
+
+    if (left > 0) {
+        png_pipeline_fail(pipe, PNG_ERR_TRUNCATED);
+    }
+
+    return NULL;
+}
+
+static void *png_pipeline_filter(void *arg) {
+    struct png_pipeline *pipe = (struct png_pipeline *) arg;
+    struct png_ctx *ctx = pipe->ctx;
+    size_t row_len = pipe->stride + 1, len, r, y = 0;
+    unsigned char bpp = pipe->stats->bit_depth;
+    unsigned char *band, *out, *row;
+    const unsigned char *above;
+    png_unfilter_fn kernels[5];
+    png_filter_fn kernel = pipe->filter_method > PNG_FILTER_PAETH ? NULL : png_filter_kernel(pipe->filter_method, bpp);
+    _Bool last = 0;
+
+    png_unfilter_kernels(bpp, kernels);
+    while (!last) {
+        if (NULL == (band = png_ring_peek(pipe, &pipe->inflated, &len, &last)) ||
+            NULL == (out = png_ring_acquire(pipe, &pipe->filtered))) {
+            return NULL;
+        }
+
+        for (r = 0; r < len / row_len; r++, y++) {
+            row = band + r * row_len;
+            above = r ? row - row_len + 1 : pipe->prev;
+            if (row[0] < 5) {
+                pipe->filter_hist[row[0]]++;
+            }
+            if (row[0] > PNG_FILTER_PAETH) {
+                png_pipeline_fail(pipe, PNG_ERR_FILTER);
+                return NULL;
+            }
+            kernels[row[0]](row + 1, above, pipe->stride, bpp);
+            if (ctx->effects.active) {
+                png_effects_row(&ctx->effects, y, out + r * row_len, row + 1, above, pipe->stride, bpp,
+                                pipe->filter_method, pipe->scratch);
+            } else if (pipe->filter_method > PNG_FILTER_PAETH) {
+                png_filter_row_adaptive(out + r * row_len, row + 1, above, pipe->stride, bpp, pipe->filter_method,
+                                        pipe->scratch);
+            } else {
+                out[r * row_len] = pipe->filter_method;
+                kernel(out + r * row_len + 1, row + 1, above, pipe->stride, bpp);
+            }
+        }
+
+        memcpy(pipe->prev, band + len - pipe->stride, pipe->stride);
+        png_ring_release(&pipe->inflated);
+        png_ring_publish(&pipe->filtered, len, last);
+    }
+
+    return NULL;
+}
+
+static void *png_pipeline_deflate(void *arg) {
+    struct png_pipeline *pipe = (struct png_pipeline *) arg;
+    z_stream *strm = &pipe->ctx->deflate_strm;
+    unsigned char *band, *idat;
+    size_t len;
+    _Bool last = 0;
+    int ret, flush;
+
+    deflateReset(strm);
+    if (NULL == (idat = png_ring_acquire(pipe, &pipe->compressed))) {
+        return NULL;
+    }
+    strm->next_out = idat;
+    strm->avail_out = PNG_PIPELINE_IDAT;
+
+    while (!last) {
+        if (NULL == (band = png_ring_peek(pipe, &pipe->filtered, &len, &last))) {
+            return NULL;
+        }
+
+        strm->next_in = band;
+        strm->avail_in = len;
+        flush = last ? Z_FINISH : Z_NO_FLUSH;
+
+        do {
+            if (strm->avail_out == 0) {
+                png_ring_publish(&pipe->compressed, PNG_PIPELINE_IDAT, 0);
+                if (NULL == (idat = png_ring_acquire(pipe, &pipe->compressed))) {
+                    return NULL;
+                }
+                strm->next_out = idat;
+                strm->avail_out = PNG_PIPELINE_IDAT;
+            }
+
+            if (Z_STREAM_ERROR == (ret = deflate(strm, flush))) {
+                png_pipeline_fail(pipe, PNG_ERR_ZLIB);
+                return NULL;
+            }
+        } while (flush == Z_FINISH ? ret != Z_STREAM_END : strm->avail_out == 0);
+
+        png_ring_release(&pipe->filtered);
+    }
+
+    png_ring_publish(&pipe->compressed, PNG_PIPELINE_IDAT - strm->avail_out, 1);
+
+    return NULL;
+}
+
+static int png_pipeline_write(struct png_pipeline *pipe, int fd) {
+    const struct png_index *index = pipe->index;
+    unsigned char *idat;
+    size_t len, offset = 0;
+    _Bool last = 0;
+
+    if (!png_stream_copy(fd, index, 0, index->idat_first)) {
+        return PNG_ERR_IO;
+    }
+
+    while (!last) {
+        if (NULL == (idat = png_ring_peek(pipe, &pipe->compressed, &len, &last))) {
+            return pipe->err;
+        }
+        png_effects_corrupt(&pipe->ctx->effects, idat, len, offset);
+        offset += len;
+        if (!png_write_chunk(fd, (const unsigned char *) "IDAT", idat, len)) {
+            return PNG_ERR_IO;
+        }
+        png_ring_release(&pipe->compressed);
+    }
+
+    return png_stream_copy(fd, index, index->idat_last, index->count) ? PNG_OK : PNG_ERR_IO;
+}
+
+static _Bool png_ring_init(struct png_arena *arena, struct png_ring *ring, size_t slot_size) {
+    memset(ring, 0, sizeof(*ring));
+    ring->slot_size = slot_size;
+    ring->data = (unsigned char *) png_arena_alloc(arena, PNG_PIPELINE_SLOTS * slot_size);
+    return NULL != ring->data;
+}
+
+int png_pipeline_glitch(struct png_ctx *ctx, const struct png_index *index, const struct png_stats *stats, int fd,
+                        unsigned char filter_method) {
+
+    static void *(*const stages[3])(void *) = {png_pipeline_inflate, png_pipeline_filter, png_pipeline_deflate};
+    struct png_pipeline pipe;
+    pthread_t workers[3];
+    size_t started, i;
+    int err;
+
+    memset(&pipe, 0, sizeof(pipe));
+    pipe.ctx = ctx;
+    pipe.index = index;
+    pipe.stats = stats;
+    pipe.filter_method = filter_method;
+    pipe.stride = png_row_stride(stats);
+    pipe.band_rows = PNG_PIPELINE_BAND / (pipe.stride + 1) ? PNG_PIPELINE_BAND / (pipe.stride + 1) : 1;
+
+    if (!png_ring_init(&ctx->arena, &pipe.inflated, pipe.band_rows * (pipe.stride + 1)) ||
+        !png_ring_init(&ctx->arena, &pipe.filtered, pipe.band_rows * (pipe.stride + 1)) ||
+        !png_ring_init(&ctx->arena, &pipe.compressed, PNG_PIPELINE_IDAT) ||
+        NULL == (pipe.prev = (unsigned char *) png_arena_calloc(&ctx->arena, pipe.stride)) ||
+        ((filter_method > PNG_FILTER_PAETH || ctx->effects.active) &&
+         NULL == (pipe.scratch = (unsigned char *) png_arena_alloc(&ctx->arena, 5 * pipe.stride)))) {
+        return PNG_ERR_NOMEM;
+    }
+
+    for (started = 0; started < 3; started++) {
+        if (pthread_create(&workers[started], NULL, stages[started], &pipe) != 0) {
+            break;
+        }
+    }
+
+    if (started < 3) {
+        png_pipeline_fail(&pipe, PNG_ERR_NOMEM);
+        err = PNG_ERR_NOMEM;
+    } else if (PNG_OK != (err = png_pipeline_write(&pipe, fd))) {
+        png_pipeline_fail(&pipe, err);
+    }
+
+    for (i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+
+    if (started < 3) {
+        return png_stream_glitch(ctx, index, stats, fd, filter_method);
+    }
+    if (PNG_OK == err) {
+        err = pipe.err;
+    }
+
+    if (png_trace_active) {
+        for (i = 0; i < 5; i++) {
+            png_trace_active->filter_hist[i] += pipe.filter_hist[i];
+        }
+        png_trace_active->raw_bytes = (size_t) stats->height * pipe.stride;
+        png_trace_active->compressed_bytes = ctx->deflate_strm.total_out;
+    }
+
+    return err;
+}
@@ -1,24 +1,35 @@
 #include "png.h"
 
-struct png_stats *png_extract_stats(const unsigned char *idat_chunk_data) {
-
-    struct png_stats *stats = (struct png_stats *) idat_chunk_data;
-    stats->width = byteswap_ulong(stats->width);
-    stats->height = byteswap_ulong(stats->height);
-
-    return stats;
-}
-
 _Bool png_validate_signature(const unsigned char *picture) {
     static const unsigned char signature[8] = "\x89PNG\r\n\x1a\n";
     return !(memcmp(picture, signature, 8));
 }
 
-_Bool png_validate_chunk(const unsigned char *picture, uint32_t from, uint32_t len, uint32_t *crc_tbl) {
-    uint32_t chunk_crc = byteswap_ulong(crc(picture, from, len, crc_tbl));
-    return !(memcmp((unsigned char *) &chunk_crc, picture+from+len, 4));
-}
-
-_Bool png_validate_hdr(const struct png_chunk_hdr *restrict hdr, const unsigned char *restrict compare) {
-    return !(memcmp(hdr->type, compare, 4));
+const char *png_strerror(int error) {
+    switch (error) {
+        case PNG_OK:
+            return "Success";
+        case PNG_ERR_NOMEM:
+            return "Failed to init buffer";
+        case PNG_ERR_IO:
+            return "Failed to read or write file";
+        case PNG_ERR_ARG:
+            return "Invalid argument";
+        case PNG_ERR_SIGNATURE:
+            return "The image does not have a valid png signature";
+        case PNG_ERR_TRUNCATED:
+            return "The image is truncated";
+        case PNG_ERR_IHDR:
+            return "Invalid IHDR chunk";
+        case PNG_ERR_CRC:
+            return "Checksum failed";
+        case PNG_ERR_NO_IDAT:
+            return "Image does not contain any IDAT chunk";
+        case PNG_ERR_ZLIB:
+            return "Invalid or incomplete deflate data";
+        case PNG_ERR_FILTER:
+            return "Invalid filter byte";
+        default:
+            return "Unknown error";
+    }
 }
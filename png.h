@@ -7,11 +7,15 @@
 #include <string.h>
 #include <zlib.h>
 
+#include "pnglitch.h"
+
 #ifdef __unix__
     #include <bytswap.h>
     #include <fcntl.h>
     #include <sys/types.h>
     #include <sys/stat.h>
+    #include <unistd.h>
+    #include <sys/uio.h>
     #define byteswap_ulong(x) bswap_32(x)
 #elif __WIN32__ || _MSC_VER
     #include <sys\stat.h>
@@ -25,6 +29,8 @@
 
 #define CHUNK 32768
 
+#define PNG_RACE_CONFIGS 10
+
 struct __attribute__((packed)) png_stats {
     uint32_t width;
     uint32_t height;
@@ -35,38 +41,310 @@ struct __attribute__((packed)) png_stats {
     unsigned char interlace_method;
 };
 
-struct png_chunk_hdr {
+typedef void (*png_unfilter_fn)(unsigned char *restrict row, const unsigned char *restrict prev, size_t stride, unsigned char bpp);
+typedef void (*png_filter_fn)(unsigned char *restrict out, const unsigned char *restrict row, const unsigned char *restrict prev, size_t stride, unsigned char bpp);
+
+struct png_chunk_desc {
+    size_t offset;
+    const unsigned char *data;
     uint32_t len;
     unsigned char type[4];
+    _Bool crc_ok;
+};
+
+struct png_index {
+    const unsigned char *base;
+    size_t size;
+    _Bool mapped;
+    _Bool owned;
+    _Bool inflated;
+    struct png_chunk_desc *chunks;
+    size_t count;
+    size_t capacity;
+    size_t idat_first;
+    size_t idat_last;
+};
+
+struct png_emitter {
+    struct iovec *iov;
+    size_t count;
+    size_t capacity;
+    unsigned char *frames;
+    size_t frames_capacity;
+    size_t total;
+};
+
+struct png_buffer {
+    unsigned char *data;
+    size_t len;
+    size_t capacity;
+};
+
+typedef int (*png_compress_fn)(struct png_ctx *ctx, const unsigned char *uncompressed, size_t strm_len, struct png_buffer *out);
+
+struct png_arena_block;
+
+struct png_arena {
+    struct png_arena_block *head;
+};
+
+struct png_cache {
+    uint64_t hash;
+    uint64_t idat_len;
+    unsigned char *map;
+    size_t map_len;
+};
+
+enum png_raw_kind {
+    PNG_RAW_NONE,
+    PNG_RAW_PNM,
+    PNG_RAW_PAM,
+    PNG_RAW_BARE
+};
+
+struct png_raw {
+    struct png_index source;
+    const unsigned char *pixels;
+    unsigned char skeleton[57];
+};
+
+struct png_effects {
+    uint64_t seed;
+    uint64_t salt;
+    uint64_t swap;
+    uint64_t bpp;
+    uint64_t shift;
+    uint64_t drift;
+    uint64_t rotate;
+    uint64_t corrupt;
+    size_t shift_max;
+    unsigned int drift_max;
+    unsigned char channels;
+    unsigned char sample;
+    _Bool active;
+};
+
+struct png_output {
+    int fd;
+    const char *path;
+    char temp[4096];
+};
+
+struct png_adam7_pass {
+    uint32_t width;
+    uint32_t height;
+    size_t stride;
+    size_t offset;
+    size_t image_offset;
+};
+
+enum png_stage {
+    PNG_STAGE_PARSE,
+    PNG_STAGE_INFLATE,
+    PNG_STAGE_UNFILTER,
+    PNG_STAGE_REFILTER,
+    PNG_STAGE_DEFLATE,
+    PNG_STAGE_WRITE,
+    PNG_STAGE_STREAM,
+    PNG_STAGE_CACHE,
+    PNG_STAGE_COUNT
 };
 
-struct png {
-    struct png_chunk_hdr *chunk_hdr;
-    unsigned char *chunk_data;
-    struct png *next;
+struct png_stage_trace {
+    double wall;
+    double cpu;
+    size_t bytes_in;
+    size_t bytes_out;
+    size_t allocs;
+    size_t reallocs;
+    size_t peak;
+    size_t runs;
+};
+
+struct png_trace {
+    struct png_stage_trace stage[PNG_STAGE_COUNT];
+    int current;
+    double wall;
+    _Bool ok;
+    uint32_t width;
+    uint32_t height;
+    unsigned char bit_depth;
+    unsigned char color_type;
+    size_t bytes_in;
+    size_t bytes_out;
+    size_t raw_bytes;
+    size_t compressed_bytes;
+    size_t filter_hist[5];
+    const char *deflate_config;
+    const char *cache;
+};
+
+extern __thread struct png_trace *png_trace_active;
+
+#define PNG_TRACE_BEGIN(stage, bytes_in) if (png_trace_active) {png_trace_begin((stage), (bytes_in));}
+#define PNG_TRACE_END(stage, bytes_out) if (png_trace_active) {png_trace_end((stage), (bytes_out));}
+#define PNG_TRACE_FILTER(type) if (png_trace_active && (type) < 5) {png_trace_active->filter_hist[(type)]++;}
+
+struct png_ctx {
+    z_stream inflate_strm;
+    z_stream deflate_strm;
+    struct png_index index;
+    struct png_emitter emitter;
+    struct png_buffer inflated;
+    struct png_buffer image;
+    struct png_buffer filtered;
+    struct png_buffer compressed;
+    struct png_buffer output;
+    struct png_buffer zero;
+    struct png_buffer candidates;
+    struct png_buffer deinterlaced;
+    struct png_buffer race[PNG_RACE_CONFIGS];
+    struct png_arena arena;
+    struct png_cache cache;
+    struct png_raw raw;
+    struct png_effects effects;
+    unsigned char ihdr[25];
+    const char *deflate_config;
+    struct png_trace trace;
 };
 
 
-struct png *png_extract_chunks(unsigned char *picture, uint32_t *crc_tbl);
-struct png_chunk_hdr *png_chunk_hdr(unsigned char *picture);
-unsigned char *png_chunk_data(uint32_t len, unsigned char *restrict picture);
-size_t png_zlib_decompress(unsigned char *compressed, size_t strm_len, unsigned char **uncompressed);
-_Bool png_validate_chunk(const unsigned char *picture, uint32_t from, uint32_t len, uint32_t *crc_tbl);
 _Bool png_validate_signature(const unsigned char *picture);
-_Bool png_validate_hdr(const struct png_chunk_hdr *restrict hdr, const unsigned char *compare);
-unsigned char *png_filter_image_fixed(const unsigned char *restrict unfiltered, size_t unfiltered_size, const struct png_stats *restrict stats, unsigned char filter_method);
-size_t png_zlib_compress(unsigned char *restrict uncompressed, size_t strm_len, unsigned char **restrict compressed);
-struct png * png_inject_data(unsigned char *restrict compressed, size_t compressed_len, uint32_t max_len);
-size_t png_recycle_chunks(struct png *restrict old_png_data, struct png *restrict idat_chunks);
-unsigned char *png_flatten_image(struct png *restrict png_linked, size_t image_size, uint32_t *crc_table);
-struct png_stats *png_extract_stats(const unsigned char *idat_chunk_data);
-void png_validate_ihdr(const struct png_stats *stats);
-size_t png_extract_data(struct png *restrict image_linked, unsigned char **restrict buffer);
-unsigned char *png_reconstruct_image(const unsigned char *restrict uncompressed, size_t reconstructed_size,
-                                     const struct png_stats *restrict stats);
-unsigned char paeth(unsigned char a, unsigned char b, unsigned char c);
-void zerr(int ret);
+int png_validate_ihdr(const struct png_stats *stats);
+int png_reconstruct_image(struct png_ctx *ctx, const unsigned char *restrict uncompressed, size_t reconstructed_size,
+                          const struct png_stats *restrict stats, struct png_buffer *out);
+int png_filter_image_fixed(struct png_ctx *ctx, const unsigned char *restrict unfiltered, size_t unfiltered_size,
+                           const struct png_stats *restrict stats, unsigned char filter_method, struct png_buffer *out);
+int png_filter_image_adaptive(struct png_ctx *ctx, const unsigned char *restrict unfiltered, size_t unfiltered_size,
+                              const struct png_stats *restrict stats, unsigned char policy, struct png_buffer *out);
+int png_zlib_compress(struct png_ctx *ctx, const unsigned char *uncompressed, size_t strm_len, struct png_buffer *out);
+int png_preview_compress(struct png_ctx *ctx, const unsigned char *uncompressed, size_t strm_len, struct png_buffer *out);
+int png_zlib_compress_parallel(struct png_arena *arena, const unsigned char *uncompressed, size_t strm_len,
+                               struct png_buffer *out, unsigned int threads, size_t block_size);
+int png_zlib_compress_race(struct png_buffer scratch[PNG_RACE_CONFIGS], const unsigned char *uncompressed, size_t strm_len,
+                           struct png_buffer *out, unsigned int budget_ms, const char **winner);
 uint32_t crc(const unsigned char *data, uint32_t offset, uint32_t len, const uint32_t *tbl);
 uint32_t *mk_crc_tbl();
+_Bool png_buffer_reserve(struct png_buffer *buffer, size_t size);
+const unsigned char *png_buffer_zero(struct png_buffer *buffer, size_t size);
+void png_buffer_free(struct png_buffer *buffer);
+void *png_arena_alloc(struct png_arena *arena, size_t size);
+void *png_arena_calloc(struct png_arena *arena, size_t size);
+void png_arena_reset(struct png_arena *arena);
+void png_arena_free(struct png_arena *arena);
+int png_batch(char **sources, int count, const char *outdir, unsigned int threads, const struct png_opts *opts);
+void png_filter_row(unsigned char *restrict filtered, const unsigned char *restrict row, const unsigned char *restrict prev, size_t stride, unsigned char bpp, unsigned char filter_method);
+void png_filter_row_adaptive(unsigned char *restrict filtered, const unsigned char *restrict row, const unsigned char *restrict prev,
+                             size_t stride, unsigned char bpp, unsigned char policy, unsigned char *restrict scratch);
+int png_filter_policy(const char *name);
+const char *png_filter_name(int policy);
+void png_unfilter_kernels(unsigned char bpp, png_unfilter_fn kernels[5]);
+png_filter_fn png_filter_kernel(unsigned char filter_method, unsigned char bpp);
+int png_filter_image_parallel(struct png_ctx *ctx, const unsigned char *restrict unfiltered, size_t unfiltered_size,
+                              const struct png_stats *restrict stats, unsigned char filter_method,
+                              struct png_buffer *out, unsigned int threads);
+const char *png_filter_isa(void);
+unsigned int png_pixel_bits(const struct png_stats *stats);
+size_t png_row_stride(const struct png_stats *stats);
+size_t png_adam7_passes(const struct png_stats *stats, struct png_adam7_pass passes[7]);
+int png_adam7_glitch(struct png_ctx *ctx, const struct png_stats *stats, const struct png_opts *opts, const unsigned char *cached);
+int png_adam7_deinterlace(struct png_ctx *ctx, const struct png_stats *stats, const unsigned char *cached);
+void png_adam7_ihdr(const struct png_index *index, unsigned char ihdr[25]);
+size_t png_cache_image_size(const struct png_stats *stats);
+void png_cache_key(struct png_cache *cache, const struct png_index *index);
+const unsigned char *png_cache_lookup(struct png_cache *cache, const struct png_stats *stats, const char *dir);
+void png_cache_release(struct png_cache *cache);
+int png_raw_stats(const char *format, struct png_stats *stats);
+void png_raw_skeleton(struct png_ctx *ctx, const struct png_stats *stats);
+int png_raw_attach(struct png_ctx *ctx, const char *format);
+void png_raw_close(struct png_ctx *ctx);
+int png_raw_kind(const char *path);
+int png_raw_decode(struct png_ctx *ctx, const struct png_stats *stats, const unsigned char **pixels, size_t *len);
+int png_raw_write(struct png_ctx *ctx, const struct png_stats *stats, const char *path, int kind);
+void png_cache_store(const struct png_cache *cache, const struct png_stats *stats, const unsigned char *image,
+                     const char *dir, size_t limit);
+int png_effects_parse(struct png_effects *fx, const char *spec, const struct png_stats *stats);
+void png_effects_row(const struct png_effects *fx, uint64_t y, unsigned char *restrict filtered,
+                     const unsigned char *row, const unsigned char *prev, size_t stride, unsigned char bpp,
+                     unsigned char filter_method, unsigned char *scratch);
+void png_effects_corrupt(const struct png_effects *fx, unsigned char *data, size_t len, size_t offset);
+int png_glitch_open(struct png_ctx *ctx, const char *input);
+int png_glitch_parse(struct png_ctx *ctx, struct png_stats *stats);
+int png_glitch_inflate(struct png_ctx *ctx, const struct png_stats *stats, const struct png_opts *opts,
+                       const unsigned char **cached);
+void png_glitch_remember(struct png_ctx *ctx, const struct png_stats *stats, const struct png_opts *opts);
+const unsigned char *png_glitch_ihdr(struct png_ctx *ctx, const struct png_stats *stats, const struct png_opts *opts);
+int png_stream_glitch(struct png_ctx *ctx, const struct png_index *index, const struct png_stats *stats, int fd, unsigned char filter_method);
+_Bool png_stream_copy(int fd, const struct png_index *index, size_t from, size_t to);
+int png_pipeline_glitch(struct png_ctx *ctx, const struct png_index *index, const struct png_stats *stats, int fd,
+                        unsigned char filter_method);
+int png_index_open(struct png_index *index, const char *path);
+void png_index_attach(struct png_index *index, const unsigned char *data, size_t size);
+void png_index_close(struct png_index *index);
+void png_index_free(struct png_index *index);
+int png_index_parse(struct png_index *index);
+void png_index_stats(const struct png_index *index, struct png_stats *stats);
+int png_index_decompress(struct png_ctx *ctx, const struct png_index *index, struct png_buffer *out);
+int png_index_receive(struct png_ctx *ctx, struct png_index *index, int fd);
+int png_emit_build(struct png_emitter *emitter, const struct png_index *index, const unsigned char *ihdr,
+                   const unsigned char *compressed, size_t compressed_len, uint32_t max_len);
+_Bool png_emit_write(int fd, struct png_emitter *emitter, _Bool use_mmap);
+int png_emit_flatten(const struct png_emitter *emitter, struct png_buffer *out);
+void png_emit_free(struct png_emitter *emitter);
+int png_emit_image(struct png_ctx *ctx, const char *output, const struct png_index *index, const unsigned char *ihdr,
+                   const unsigned char *compressed, size_t compressed_len, uint32_t max_len, _Bool use_mmap);
+uint32_t png_crc32(uint32_t crc, const unsigned char *data, size_t len);
+uint32_t png_crc32_combine(uint32_t crc1, uint32_t crc2, size_t len2);
+const char *png_crc32_engine(void);
+_Bool png_crc32_selftest(const uint32_t *tbl);
+int png_output_begin(struct png_output *out, const char *path);
+int png_output_end(struct png_output *out, int err);
+_Bool png_write_all(int fd, const unsigned char *buffer, size_t len);
+_Bool png_write_chunk(int fd, const unsigned char *type, const unsigned char *data, uint32_t len);
+
+void png_trace_start(struct png_trace *trace);
+void png_trace_stop(struct png_trace *trace);
+void png_trace_begin(int stage, size_t bytes_in);
+void png_trace_end(int stage, size_t bytes_out);
+void png_trace_alloc(size_t size, _Bool is_realloc);
+void png_trace_report(const struct png_trace *trace, const char *input, const char *output);
+const char *png_json_escape(char *buffer, size_t size, const char *text);
+int png_serve(const char *socket_path, unsigned int threads, unsigned int max_inflight, const struct png_opts *opts);
+
+static inline void *png_calloc(size_t n, size_t size) {
+    if (png_trace_active) {
+        png_trace_alloc(n * size, 0);
+    }
+    return calloc(n, size);
+}
+
+static inline void *png_malloc(size_t size) {
+    if (png_trace_active) {
+        png_trace_alloc(size, 0);
+    }
+    return malloc(size);
+}
+
+static inline void *png_realloc(void *ptr, size_t size) {
+    if (png_trace_active) {
+        png_trace_alloc(size, 1);
+    }
+    return realloc(ptr, size);
+}
+
+static inline unsigned char paeth(unsigned char a, unsigned char b, unsigned char c) {
+    unsigned char p = a + b - c;
+    unsigned char pa = abs(p - a);
+    unsigned char pb = abs(p - b);
+    unsigned char pc = abs(p - c);
+
+    if (pa <= pb && pa <= pc) {
+        return a;
+    } else if (pb <= pc) {
+        return b;
+    } else {
+        return c;
+    }
+}
 
 #endif
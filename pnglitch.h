@@ -0,0 +1,76 @@
+#ifndef PNGLITCH_H
+#define PNGLITCH_H
+
+#include <stddef.h>
+
+enum png_error {
+    PNG_OK,
+    PNG_ERR_NOMEM,
+    PNG_ERR_IO,
+    PNG_ERR_ARG,
+    PNG_ERR_SIGNATURE,
+    PNG_ERR_TRUNCATED,
+    PNG_ERR_IHDR,
+    PNG_ERR_CRC,
+    PNG_ERR_NO_IDAT,
+    PNG_ERR_ZLIB,
+    PNG_ERR_FILTER
+};
+
+enum png_filter_policy {
+    PNG_FILTER_NONE,
+    PNG_FILTER_SUB,
+    PNG_FILTER_UP,
+    PNG_FILTER_AVG,
+    PNG_FILTER_PAETH,
+    PNG_FILTER_MSAD,
+    PNG_FILTER_ENTROPY
+};
+
+struct png_opts {
+    unsigned char filter_method;
+    _Bool stream;
+    unsigned int deflate_threads;
+    size_t block_size;
+    _Bool mmap_output;
+    _Bool stats_json;
+    _Bool race;
+    unsigned int race_budget_ms;
+    _Bool progressive;
+    const char *cache_dir;
+    size_t cache_size;
+    _Bool pipeline;
+    unsigned int filter_threads;
+    const char *raw_format;
+    /* Comma separated seed=N, swap|bpp|shift|drift|rotate=P and corrupt=P; shift and drift take an optional :MAX. */
+    const char *effects;
+    _Bool preview;
+};
+
+struct png_variant {
+    unsigned char filter_method;
+    unsigned char bpp;
+    int level;
+};
+
+struct png_ctx;
+
+/* Fills in the command-line defaults: Paeth refilter, one thread per stage, 128 KiB deflate blocks, 1 GiB cache. */
+void png_opts_init(struct png_opts *opts);
+struct png_ctx *png_ctx_create(void);
+void png_ctx_destroy(struct png_ctx *ctx);
+
+/* The output points into the context and stays valid until the next call on it. */
+int png_glitch_buffer(struct png_ctx *ctx, const unsigned char *input, size_t input_len,
+                      const unsigned char **output, size_t *output_len, const struct png_opts *opts);
+int png_glitch_file(struct png_ctx *ctx, const char *input, const char *output, const struct png_opts *opts);
+/* Decodes once and writes one output per variant; {filter}, {bpp}, {level} and {n} in the template are expanded. */
+int png_glitch_fanout(struct png_ctx *ctx, const char *input, const char *output_template,
+                      const struct png_variant *variants, size_t count, unsigned int threads, const struct png_opts *opts);
+/* Glitches fixed-size raw frames from in_fd until end of input, writing them in order to out_fd or to a numbered PNG per frame. */
+int png_glitch_sequence(const char *format, int in_fd, int out_fd, const char *output_template, unsigned int threads,
+                        const struct png_opts *opts, size_t *frames);
+const char *png_ctx_deflate_config(const struct png_ctx *ctx);
+const char *png_strerror(int error);
+
+#endif
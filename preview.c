@@ -0,0 +1,164 @@
+#include "png.h"
+
+#include <pthread.h>
+
+#define PNG_PREVIEW_BLOCK 65535
+#define PNG_PREVIEW_MAX_RUN 258
+
+struct png_bits {
+    unsigned char *out;
+    size_t pos;
+    uint64_t acc;
+    unsigned int count;
+};
+
+static const uint16_t png_length_base[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83,
+                                             99, 115, 131, 163, 195, 227, 258};
+static const unsigned char png_length_extra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4,
+                                                   5, 5, 5, 5, 0};
+
+static uint16_t literal_code[256];
+static unsigned char literal_bits[256];
+static uint32_t run_code[PNG_PREVIEW_MAX_RUN + 1];
+static unsigned char run_bits[PNG_PREVIEW_MAX_RUN + 1];
+static pthread_once_t preview_once = PTHREAD_ONCE_INIT;
+
+static uint32_t png_reverse_bits(uint32_t code, unsigned int len) {
+    uint32_t out = 0;
+    unsigned int i;
+
+    for (i = 0; i < len; i++) {
+        out = (out << 1) | ((code >> i) & 1);
+    }
+
+    return out;
+}
+
+/* fixed Huffman codes, bit-reversed so they can be OR'ed into an LSB-first stream */
+static void png_preview_tables_init(void) {
+    unsigned int s, len, sym, bits;
+
+    for (s = 0; s < 256; s++) {
+        literal_bits[s] = s < 144 ? 8 : 9;
+        literal_code[s] = (uint16_t) png_reverse_bits(s < 144 ? 0x30 + s : 0x190 + s - 144, literal_bits[s]);
+    }
+
+    for (len = 3, sym = 0; len <= PNG_PREVIEW_MAX_RUN; len++) {
+        while (sym < 28 && len >= png_length_base[sym + 1]) {
+            sym++;
+        }
+        bits = sym + 257 < 280 ? 7 : 8;
+        run_code[len] = png_reverse_bits(sym + 257 < 280 ? sym + 1 : 0xC0 + sym + 257 - 280, bits);
+        run_code[len] |= (uint32_t) (len - png_length_base[sym]) << bits;
+        /* distance 1 is code 0 in five bits, which leaves the top of the code zero */
+        run_bits[len] = (unsigned char) (bits + png_length_extra[sym] + 5);
+    }
+}
+
+static inline void png_bits_put(struct png_bits *bits, uint32_t code, unsigned int len) {
+    bits->acc |= (uint64_t) code << bits->count;
+    bits->count += len;
+    if (bits->count >= 32) {
+        bits->out[bits->pos] = (unsigned char) bits->acc;
+        bits->out[bits->pos + 1] = (unsigned char) (bits->acc >> 8);
+        bits->out[bits->pos + 2] = (unsigned char) (bits->acc >> 16);
+        bits->out[bits->pos + 3] = (unsigned char) (bits->acc >> 24);
+        bits->pos += 4;
+        bits->acc >>= 32;
+        bits->count -= 32;
+    }
+}
+
+static void png_bits_align(struct png_bits *bits) {
+    while (bits->count > 0) {
+        bits->out[bits->pos++] = (unsigned char) bits->acc;
+        bits->acc >>= 8;
+        bits->count = bits->count > 8 ? bits->count - 8 : 0;
+    }
+}
+
+static void png_preview_fixed(struct png_bits *bits, const unsigned char *data, size_t start, size_t end, _Bool last) {
+    size_t i = start, run, limit;
+    unsigned char c;
+
+    png_bits_put(bits, last ? 3 : 2, 3);
+
+    while (i < end) {
+        c = data[i];
+        if (i > 0 && data[i - 1] == c) {
+            limit = end - i < PNG_PREVIEW_MAX_RUN ? end - i : PNG_PREVIEW_MAX_RUN;
+            for (run = 1; run < limit && data[i + run] == c; run++) {
+            }
+            if (run >= 3) {
+                png_bits_put(bits, run_code[run], run_bits[run]);
+                i += run;
+                continue;
+            }
+        }
+        png_bits_put(bits, literal_code[c], literal_bits[c]);
+        i++;
+    }
+
+    png_bits_put(bits, 0, 7);
+}
+
+static void png_preview_stored(struct png_bits *bits, const unsigned char *data, size_t start, size_t end, _Bool last) {
+    size_t len = end - start;
+
+    png_bits_put(bits, last ? 1 : 0, 3);
+    png_bits_align(bits);
+
+    bits->out[bits->pos] = (unsigned char) len;
+    bits->out[bits->pos + 1] = (unsigned char) (len >> 8);
+    bits->out[bits->pos + 2] = (unsigned char) ~len;
+    bits->out[bits->pos + 3] = (unsigned char) (~len >> 8);
+    memcpy(bits->out + bits->pos + 4, data + start, len);
+    bits->pos += 4 + len;
+}
+
+int png_preview_compress(struct png_ctx *ctx, const unsigned char *uncompressed, size_t strm_len, struct png_buffer *out) {
+    struct png_bits bits, mark;
+    size_t start = 0, end, piece;
+    uLong adler = adler32(0L, Z_NULL, 0);
+    _Bool last;
+
+    pthread_once(&preview_once, png_preview_tables_init);
+
+    if (!png_buffer_reserve(out, strm_len + strm_len / 8 + 5 * (strm_len / PNG_PREVIEW_BLOCK + 1) + 16)) {
+        return PNG_ERR_NOMEM;
+    }
+
+    memset(&bits, 0, sizeof(bits));
+    bits.out = out->data;
+    bits.out[0] = 0x78;
+    bits.out[1] = 0x01;
+    bits.pos = 2;
+
+    do {
+        end = strm_len - start > PNG_PREVIEW_BLOCK ? start + PNG_PREVIEW_BLOCK : strm_len;
+        last = end == strm_len;
+
+        mark = bits;
+        png_preview_fixed(&bits, uncompressed, start, end, last);
+        if (bits.pos > mark.pos + (end - start) + 5) {
+            bits = mark;
+            png_preview_stored(&bits, uncompressed, start, end, last);
+        }
+
+        start = end;
+    } while (!last);
+
+    png_bits_align(&bits);
+
+    for (start = 0; start < strm_len; start += piece) {
+        piece = strm_len - start > (1u << 30) ? (1u << 30) : strm_len - start;
+        adler = adler32(adler, uncompressed + start, (uInt) piece);
+    }
+    bits.out[bits.pos] = (unsigned char) (adler >> 24);
+    bits.out[bits.pos + 1] = (unsigned char) (adler >> 16);
+    bits.out[bits.pos + 2] = (unsigned char) (adler >> 8);
+    bits.out[bits.pos + 3] = (unsigned char) adler;
+
+    out->len = bits.pos + 4;
+    return PNG_OK;
+}
@@ -0,0 +1,200 @@
+#include "png.h"
+
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+
+#define PNG_RACE_STEP (256 << 10)
+
+struct png_race_config {
+    const char *name;
+    int level;
+    int strategy;
+    int mem_level;
+    int window_bits;
+};
+
+static const struct png_race_config png_race_configs[PNG_RACE_CONFIGS] = {
+        {"level=6",                 6, Z_DEFAULT_STRATEGY, 8, 15},
+        {"level=9",                 9, Z_DEFAULT_STRATEGY, 8, 15},
+        {"level=9 mem=9",           9, Z_DEFAULT_STRATEGY, 9, 15},
+        {"level=9 mem=9 window=14", 9, Z_DEFAULT_STRATEGY, 9, 14},
+        {"level=6 filtered",        6, Z_FILTERED,         8, 15},
+        {"level=9 filtered",        9, Z_FILTERED,         8, 15},
+        {"level=9 filtered mem=9",  9, Z_FILTERED,         9, 15},
+        {"rle mem=9",               6, Z_RLE,              9, 15},
+        {"huffman mem=9",           6, Z_HUFFMAN_ONLY,     9, 15},
+        {"level=1",                 1, Z_DEFAULT_STRATEGY, 8, 15}
+};
+
+enum png_race_state {
+    PNG_RACE_RUNNING,
+    PNG_RACE_DONE,
+    PNG_RACE_CANCELLED,
+    PNG_RACE_FAILED
+};
+
+struct png_race_entry {
+    struct png_race *race;
+    const struct png_race_config *config;
+    struct png_buffer out;
+    int state;
+};
+
+struct png_race {
+    const unsigned char *input;
+    size_t len;
+    double deadline;
+
+    pthread_mutex_t lock;
+    size_t best;
+};
+
+static double png_race_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+static _Bool png_race_losing(struct png_race_entry *entry, size_t produced) {
+    struct png_race *race = entry->race;
+    size_t best;
+
+    pthread_mutex_lock(&race->lock);
+    best = race->best;
+    pthread_mutex_unlock(&race->lock);
+
+    if (produced >= best) {
+        return 1;
+    }
+    return entry->config != png_race_configs && race->deadline > 0 && png_race_now() > race->deadline;
+}
+
+static void *png_race_worker(void *arg) {
+    struct png_race_entry *entry = (struct png_race_entry *) arg;
+    struct png_race *race = entry->race;
+    const struct png_race_config *config = entry->config;
+    const unsigned char *next = race->input;
+    size_t left = race->len, piece;
+    z_stream stream;
+    int ret, flush = Z_NO_FLUSH;
+
+    memset(&stream, 0, sizeof(stream));
+    if (Z_OK != deflateInit2(&stream, config->level, Z_DEFLATED, config->window_bits, config->mem_level, config->strategy)) {
+        entry->state = PNG_RACE_FAILED;
+        return NULL;
+    }
+
+    if (!png_buffer_reserve(&entry->out, race->len / 2 + CHUNK)) {
+        entry->state = PNG_RACE_FAILED;
+        deflateEnd(&stream);
+        return NULL;
+    }
+    stream.next_out = entry->out.data;
+    stream.avail_out = entry->out.capacity > UINT_MAX ? UINT_MAX : entry->out.capacity;
+
+    do {
+        if (stream.avail_in == 0 && flush != Z_FINISH) {
+            if (png_race_losing(entry, stream.total_out)) {
+                entry->state = PNG_RACE_CANCELLED;
+                break;
+            }
+            piece = left > PNG_RACE_STEP ? PNG_RACE_STEP : left;
+            stream.next_in = (unsigned char *) next;
+            stream.avail_in = piece;
+            next += piece;
+            left -= piece;
+            flush = left ? Z_NO_FLUSH : Z_FINISH;
+        }
+
+        if (stream.avail_out == 0) {
+            if (!png_buffer_reserve(&entry->out, entry->out.capacity + 1)) {
+                entry->state = PNG_RACE_FAILED;
+                break;
+            }
+            piece = entry->out.capacity - stream.total_out;
+            stream.next_out = entry->out.data + stream.total_out;
+            stream.avail_out = piece > UINT_MAX ? UINT_MAX : piece;
+        }
+
+        if (Z_STREAM_ERROR == (ret = deflate(&stream, flush))) {
+            entry->state = PNG_RACE_FAILED;
+            break;
+        }
+    } while (Z_STREAM_END != ret);
+
+    if (entry->state == PNG_RACE_RUNNING) {
+        entry->out.len = stream.total_out;
+        pthread_mutex_lock(&race->lock);
+        if (entry->out.len < race->best) {
+            race->best = entry->out.len;
+        }
+        pthread_mutex_unlock(&race->lock);
+        entry->state = PNG_RACE_DONE;
+    }
+
+    deflateEnd(&stream);
+    return NULL;
+}
+
+int png_zlib_compress_race(struct png_buffer scratch[PNG_RACE_CONFIGS], const unsigned char *uncompressed, size_t strm_len,
+                           struct png_buffer *out, unsigned int budget_ms, const char **winner) {
+
+    struct png_race race;
+    struct png_race_entry entries[PNG_RACE_CONFIGS];
+    pthread_t workers[PNG_RACE_CONFIGS];
+    _Bool started[PNG_RACE_CONFIGS];
+    struct png_buffer swap;
+    size_t i, best = PNG_RACE_CONFIGS;
+    int err = PNG_OK;
+
+    memset(&race, 0, sizeof(race));
+    race.input = uncompressed;
+    race.len = strm_len;
+    race.best = (size_t) -1;
+    race.deadline = budget_ms ? png_race_now() + budget_ms / 1e3 : 0;
+    pthread_mutex_init(&race.lock, NULL);
+
+    memset(entries, 0, sizeof(entries));
+    for (i = 0; i < PNG_RACE_CONFIGS; i++) {
+        entries[i].race = &race;
+        entries[i].config = &png_race_configs[i];
+        entries[i].out = scratch[i];
+        entries[i].out.len = 0;
+        started[i] = i > 0 && pthread_create(&workers[i], NULL, png_race_worker, &entries[i]) == 0;
+        if (i > 0 && !started[i]) {
+            entries[i].state = PNG_RACE_CANCELLED;
+        }
+    }
+
+    png_race_worker(&entries[0]);
+    for (i = 1; i < PNG_RACE_CONFIGS; i++) {
+        if (started[i]) {
+            pthread_join(workers[i], NULL);
+        }
+    }
+
+    for (i = 0; i < PNG_RACE_CONFIGS; i++) {
+        if (entries[i].state == PNG_RACE_DONE && (best == PNG_RACE_CONFIGS || entries[i].out.len < entries[best].out.len)) {
+            best = i;
+        }
+    }
+
+    if (best == PNG_RACE_CONFIGS) {
+        err = PNG_ERR_NOMEM;
+    } else {
+        swap = *out;
+        *out = entries[best].out;
+        entries[best].out = swap;
+        if (NULL != winner) {
+            *winner = png_race_configs[best].name;
+        }
+    }
+
+    for (i = 0; i < PNG_RACE_CONFIGS; i++) {
+        scratch[i] = entries[i].out;
+    }
+    pthread_mutex_destroy(&race.lock);
+
+    return err;
+}
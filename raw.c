@@ -0,0 +1,412 @@
+#include "png.h"
+
+#include <ctype.h>
+
+static const unsigned char png_raw_color_types[5] = {0, 0, 4, 2, 6};
+
+static const unsigned char *png_raw_number(const unsigned char *p, const unsigned char *end, unsigned long *value) {
+    while (p < end && (isspace(*p) || *p == '#')) {
+        if (*p == '#') {
+            while (p < end && *p != '\n') {
+                p++;
+            }
+        } else {
+            p++;
+        }
+    }
+
+    if (p == end || !isdigit(*p)) {
+        return NULL;
+    }
+
+    for (*value = 0; p < end && isdigit(*p) && *value <= 0xFFFFFFFFUL; p++) {
+        *value = *value * 10 + (*p - '0');
+    }
+
+    return p;
+}
+
+static const unsigned char *png_raw_pnm(const unsigned char *p, const unsigned char *end, unsigned long *width,
+                                        unsigned long *height, unsigned long *depth, unsigned long *maxval) {
+    *depth = p[1] == '5' ? 1 : 3;
+    p += 2;
+
+    if (NULL == (p = png_raw_number(p, end, width)) || NULL == (p = png_raw_number(p, end, height)) ||
+        NULL == (p = png_raw_number(p, end, maxval)) || p == end || !isspace(*p)) {
+        return NULL;
+    }
+
+    return p + 1;
+}
+
+static const unsigned char *png_raw_pam(const unsigned char *p, const unsigned char *end, unsigned long *width,
+                                        unsigned long *height, unsigned long *depth, unsigned long *maxval) {
+    const unsigned char *line;
+    size_t len;
+
+    for (p += 3; p < end; p = line + 1) {
+        if (NULL == (line = (const unsigned char *) memchr(p, '\n', end - p))) {
+            return NULL;
+        }
+        len = line - p;
+
+        if (len >= 6 && !memcmp(p, "ENDHDR", 6)) {
+            return line + 1;
+        } else if (len > 5 && !memcmp(p, "WIDTH", 5)) {
+            png_raw_number(p + 5, line, width);
+        } else if (len > 6 && !memcmp(p, "HEIGHT", 6)) {
+            png_raw_number(p + 6, line, height);
+        } else if (len > 5 && !memcmp(p, "DEPTH", 5)) {
+            png_raw_number(p + 5, line, depth);
+        } else if (len > 6 && !memcmp(p, "MAXVAL", 6)) {
+            png_raw_number(p + 6, line, maxval);
+        }
+    }
+
+    return NULL;
+}
+
+static int png_raw_format(const char *format, unsigned long *width, unsigned long *height, unsigned long *depth,
+                          unsigned long *maxval) {
+    static const char *const names[5] = {NULL, "gray", "graya", "rgb", "rgba"};
+    char name[16];
+    size_t len;
+
+    if (sscanf(format, "%lux%lu:%15s", width, height, name) != 3) {
+        return PNG_ERR_ARG;
+    }
+
+    *maxval = 255;
+    len = strlen(name);
+    if (len > 2 && !strcmp(name + len - 2, "16")) {
+        name[len - 2] = '\0';
+        *maxval = 65535;
+    }
+
+    for (*depth = 1; *depth < 5; (*depth)++) {
+        if (!strcmp(name, names[*depth])) {
+            return PNG_OK;
+        }
+    }
+
+    return PNG_ERR_ARG;
+}
+
+static void png_raw_chunk(unsigned char *out, const char *type, const unsigned char *data, uint32_t len) {
+    uint32_t be = byteswap_ulong(len);
+
+    memcpy(out, &be, 4);
+    memcpy(out + 4, type, 4);
+    if (len) {
+        memcpy(out + 8, data, len);
+    }
+    be = byteswap_ulong(png_crc32(0, out + 4, len + 4));
+    memcpy(out + 8 + len, &be, 4);
+}
+
+static int png_raw_fill(struct png_stats *stats, unsigned long width, unsigned long height, unsigned long depth,
+                        unsigned long maxval) {
+    if (width == 0 || height == 0 || width > 0x7FFFFFFFUL || height > 0x7FFFFFFFUL ||
+        depth == 0 || depth > 4 || maxval == 0 || maxval > 65535) {
+        return PNG_ERR_IHDR;
+    }
+
+    memset(stats, 0, sizeof(*stats));
+    stats->width = (uint32_t) width;
+    stats->height = (uint32_t) height;
+    stats->bit_depth = maxval > 255 ? 16 : 8;
+    stats->color_type = png_raw_color_types[depth];
+
+    return PNG_OK;
+}
+
+int png_raw_stats(const char *format, struct png_stats *stats) {
+    unsigned long width, height, depth, maxval;
+
+    if (PNG_OK != png_raw_format(format, &width, &height, &depth, &maxval)) {
+        return PNG_ERR_ARG;
+    }
+
+    return png_raw_fill(stats, width, height, depth, maxval);
+}
+
+void png_raw_skeleton(struct png_ctx *ctx, const struct png_stats *stats) {
+    unsigned char ihdr[13];
+    uint32_t be;
+
+    be = byteswap_ulong(stats->width);
+    memcpy(ihdr, &be, 4);
+    be = byteswap_ulong(stats->height);
+    memcpy(ihdr + 4, &be, 4);
+    ihdr[8] = stats->bit_depth;
+    ihdr[9] = stats->color_type;
+    memset(ihdr + 10, 0, 3);
+
+    memcpy(ctx->raw.skeleton, "\x89PNG\r\n\x1a\n", 8);
+    png_raw_chunk(ctx->raw.skeleton + 8, "IHDR", ihdr, 13);
+    png_raw_chunk(ctx->raw.skeleton + 33, "IDAT", NULL, 0);
+    png_raw_chunk(ctx->raw.skeleton + 45, "IEND", NULL, 0);
+
+    png_index_attach(&ctx->index, ctx->raw.skeleton, sizeof(ctx->raw.skeleton));
+}
+
+int png_raw_attach(struct png_ctx *ctx, const char *format) {
+    const unsigned char *p = ctx->index.base, *end = ctx->index.base + ctx->index.size;
+    unsigned long width = 0, height = 0, depth = 0, maxval = 0;
+    struct png_stats stats;
+    size_t stride;
+    int err;
+
+    ctx->raw.pixels = NULL;
+
+    if (NULL != format) {
+        if (PNG_OK != (err = png_raw_format(format, &width, &height, &depth, &maxval))) {
+            return err;
+        }
+    } else if (ctx->index.size >= 3 && p[0] == 'P' && (p[1] == '5' || p[1] == '6') && isspace(p[2])) {
+        p = png_raw_pnm(p, end, &width, &height, &depth, &maxval);
+    } else if (ctx->index.size >= 3 && p[0] == 'P' && p[1] == '7' && p[2] == '\n') {
+        p = png_raw_pam(p, end, &width, &height, &depth, &maxval);
+    } else {
+        return PNG_OK;
+    }
+
+    if (NULL == p || PNG_OK != png_raw_fill(&stats, width, height, depth, maxval)) {
+        return PNG_ERR_IHDR;
+    }
+    stride = png_row_stride(&stats);
+    if (stats.height > SIZE_MAX / stride || (size_t) (end - p) < stride * stats.height) {
+        return PNG_ERR_TRUNCATED;
+    }
+
+    ctx->raw.source = ctx->index;
+    ctx->raw.source.chunks = NULL;
+    ctx->raw.source.count = 0;
+    ctx->raw.source.capacity = 0;
+    ctx->raw.pixels = p;
+    ctx->index.owned = 0;
+    png_raw_skeleton(ctx, &stats);
+
+    return PNG_OK;
+}
+
+void png_raw_close(struct png_ctx *ctx) {
+    png_index_close(&ctx->raw.source);
+    ctx->raw.pixels = NULL;
+}
+
+int png_raw_kind(const char *path) {
+    const char *ext = strrchr(path, '.');
+
+    if (NULL == ext) {
+        return PNG_RAW_NONE;
+    }
+    if (!strcmp(ext, ".pam")) {
+        return PNG_RAW_PAM;
+    }
+    if (!strcmp(ext, ".pnm") || !strcmp(ext, ".ppm") || !strcmp(ext, ".pgm")) {
+        return PNG_RAW_PNM;
+    }
+    if (!strcmp(ext, ".raw") || !strcmp(ext, ".rgba")) {
+        return PNG_RAW_BARE;
+    }
+
+    return PNG_RAW_NONE;
+}
+
+static const unsigned char *png_raw_palette(const struct png_index *index, size_t *entries) {
+    size_t i;
+
+    for (i = 0; i < index->idat_first; i++) {
+        if (!memcmp(index->chunks[i].type, "PLTE", 4)) {
+            *entries = index->chunks[i].len / 3;
+            return index->chunks[i].data;
+        }
+    }
+
+    *entries = 0;
+    return NULL;
+}
+
+static void png_raw_expand(unsigned char *out, const unsigned char *row, const struct png_stats *stats,
+                           size_t samples, const unsigned char *palette, size_t entries) {
+    unsigned int bits = stats->bit_depth, mask = (1u << bits) - 1, value;
+    size_t i, offset;
+
+    for (i = 0, offset = 0; i < samples; i++, offset += bits) {
+        value = bits == 8 ? row[i] : (row[offset / 8] >> (8 - bits - offset % 8)) & mask;
+        if (NULL == palette) {
+            *out++ = (unsigned char) value;
+        } else if (value < entries) {
+            memcpy(out, palette + 3 * value, 3);
+            out += 3;
+        } else {
+            memset(out, 0, 3);
+            out += 3;
+        }
+    }
+}
+
+typedef void (*png_raw_unfilter_fn)(unsigned char *restrict row, const unsigned char *restrict in,
+                                    const unsigned char *restrict prev, size_t stride);
+
+static inline unsigned char png_raw_paeth(int a, int b, int c) {
+    int pa = abs(b - c), pb = abs(a - c), pc = abs(a + b - 2 * c);
+    return (unsigned char) (pa <= pb && pa <= pc ? a : pb <= pc ? b : c);
+}
+
+static void png_raw_none(unsigned char *restrict row, const unsigned char *restrict in, const unsigned char *restrict prev,
+                         size_t stride) {
+    memcpy(row, in, stride);
+}
+
+static void png_raw_up(unsigned char *restrict row, const unsigned char *restrict in, const unsigned char *restrict prev,
+                       size_t stride) {
+    size_t i;
+    for (i = 0; i < stride; i++) {
+        row[i] = in[i] + prev[i];
+    }
+}
+
+#define PNG_RAW_KERNELS(N)                                                                                              \
+static void png_raw_sub_##N(unsigned char *restrict row, const unsigned char *restrict in,                              \
+                            const unsigned char *restrict prev, size_t stride) {                                        \
+    size_t i, head = N < stride ? N : stride;                                                                           \
+    memcpy(row, in, head);                                                                                              \
+    for (i = head; i < stride; i++) {                                                                                   \
+        row[i] = in[i] + row[i - N];                                                                                    \
+    }                                                                                                                   \
+}                                                                                                                       \
+                                                                                                                        \
+static void png_raw_avg_##N(unsigned char *restrict row, const unsigned char *restrict in,                              \
+                            const unsigned char *restrict prev, size_t stride) {                                        \
+    size_t i, head = N < stride ? N : stride;                                                                           \
+    for (i = 0; i < head; i++) {                                                                                        \
+        row[i] = in[i] + prev[i] / 2;                                                                                   \
+    }                                                                                                                   \
+    for (; i < stride; i++) {                                                                                           \
+        row[i] = in[i] + (row[i - N] + prev[i]) / 2;                                                                    \
+    }                                                                                                                   \
+}                                                                                                                       \
+                                                                                                                        \
+static void png_raw_paeth_##N(unsigned char *restrict row, const unsigned char *restrict in,                            \
+                              const unsigned char *restrict prev, size_t stride) {                                      \
+    size_t i, head = N < stride ? N : stride;                                                                           \
+    for (i = 0; i < head; i++) {                                                                                        \
+        row[i] = in[i] + prev[i];                                                                                       \
+    }                                                                                                                   \
+    for (; i < stride; i++) {                                                                                           \
+        row[i] = in[i] + png_raw_paeth(row[i - N], prev[i], prev[i - N]);                                               \
+    }                                                                                                                   \
+}
+
+PNG_RAW_KERNELS(1)
+PNG_RAW_KERNELS(2)
+PNG_RAW_KERNELS(3)
+PNG_RAW_KERNELS(4)
+PNG_RAW_KERNELS(6)
+PNG_RAW_KERNELS(8)
+
+#define PNG_RAW_ROW(N) {png_raw_none, png_raw_sub_##N, png_raw_up, png_raw_avg_##N, png_raw_paeth_##N}
+
+/* indexed by bytes per pixel, which is all png_validate_ihdr lets through */
+static const png_raw_unfilter_fn png_raw_kernels[9][5] = {
+        [1] = PNG_RAW_ROW(1),
+        [2] = PNG_RAW_ROW(2),
+        [3] = PNG_RAW_ROW(3),
+        [4] = PNG_RAW_ROW(4),
+        [6] = PNG_RAW_ROW(6),
+        [8] = PNG_RAW_ROW(8)
+};
+
+int png_raw_decode(struct png_ctx *ctx, const struct png_stats *stats, const unsigned char **pixels, size_t *len) {
+    unsigned int bits = png_pixel_bits(stats), channels = bits / stats->bit_depth;
+    unsigned char bpp = bits < 8 ? 1 : bits / 8;
+    size_t stride = png_row_stride(stats), out_stride, entries = 0;
+    const unsigned char *filtered = ctx->filtered.data, *prev, *palette = NULL;
+    const png_raw_unfilter_fn *kernels = png_raw_kernels[bpp];
+    unsigned char *row;
+    int err = PNG_OK;
+    uint32_t h;
+
+    if (stats->color_type == 3 && NULL == (palette = png_raw_palette(&ctx->index, &entries))) {
+        return PNG_ERR_IHDR;
+    }
+    out_stride = (size_t) stats->width * (NULL != palette ? 3 : channels) * (stats->bit_depth == 16 ? 2 : 1);
+
+    if (ctx->filtered.len < (stride + 1) * stats->height) {
+        return PNG_ERR_TRUNCATED;
+    }
+    if (!png_buffer_reserve(&ctx->image, stride * stats->height) || NULL == (prev = png_buffer_zero(&ctx->zero, stride))) {
+        return PNG_ERR_NOMEM;
+    }
+
+    PNG_TRACE_BEGIN(PNG_STAGE_UNFILTER, ctx->filtered.len)
+    for (h = 0, row = ctx->image.data; h < stats->height && PNG_OK == err; h++, row += stride, filtered += stride + 1) {
+        if (filtered[0] > PNG_FILTER_PAETH) {
+            err = PNG_ERR_FILTER;
+        } else {
+            kernels[filtered[0]](row, filtered + 1, prev, stride);
+        }
+        prev = row;
+    }
+    PNG_TRACE_END(PNG_STAGE_UNFILTER, stride * stats->height)
+    if (PNG_OK != err) {
+        return err;
+    }
+
+    *pixels = ctx->image.data;
+    *len = out_stride * stats->height;
+    if (out_stride != stride) {
+        if (!png_buffer_reserve(&ctx->output, out_stride * stats->height)) {
+            return PNG_ERR_NOMEM;
+        }
+        for (h = 0; h < stats->height; h++) {
+            png_raw_expand(ctx->output.data + h * out_stride, ctx->image.data + h * stride, stats,
+                           (size_t) stats->width * channels, palette, entries);
+        }
+        *pixels = ctx->output.data;
+    }
+
+    return PNG_OK;
+}
+
+int png_raw_write(struct png_ctx *ctx, const struct png_stats *stats, const char *path, int kind) {
+    static const char *const tupltypes[5] = {NULL, "GRAYSCALE", "GRAYSCALE_ALPHA", "RGB", "RGB_ALPHA"};
+    unsigned int depth = stats->color_type == 3 ? 3 : png_pixel_bits(stats) / stats->bit_depth;
+    unsigned int maxval = stats->color_type == 3 ? 255 : (1u << stats->bit_depth) - 1;
+    const unsigned char *out;
+    size_t out_len;
+    char header[128];
+    struct png_output output;
+    int len = 0, err;
+    _Bool ok;
+
+    if (PNG_OK != (err = png_raw_decode(ctx, stats, &out, &out_len))) {
+        return err;
+    }
+
+    if (kind == PNG_RAW_PNM && (depth == 1 || depth == 3)) {
+        len = snprintf(header, sizeof(header), "P%c\n%u %u\n%u\n", depth == 1 ? '5' : '6', stats->width,
+                       stats->height, maxval);
+    } else if (kind != PNG_RAW_BARE) {
+        len = snprintf(header, sizeof(header), "P7\nWIDTH %u\nHEIGHT %u\nDEPTH %u\nMAXVAL %u\nTUPLTYPE %s\nENDHDR\n",
+                       stats->width, stats->height, depth, maxval, tupltypes[depth]);
+    }
+
+    if (PNG_OK != (err = png_output_begin(&output, path))) {
+        return err;
+    }
+    PNG_TRACE_BEGIN(PNG_STAGE_WRITE, out_len)
+    ok = png_write_all(output.fd, (const unsigned char *) header, len) && png_write_all(output.fd, out, out_len);
+    PNG_TRACE_END(PNG_STAGE_WRITE, len + out_len)
+    if (PNG_OK != (err = png_output_end(&output, ok ? PNG_OK : PNG_ERR_IO))) {
+        return err;
+    }
+
+    if (png_trace_active) {
+        png_trace_active->raw_bytes = png_row_stride(stats) * stats->height;
+    }
+
+    return PNG_OK;
+}
@@ -0,0 +1,267 @@
+#include "png.h"
+
+#include <errno.h>
+#include <pthread.h>
+
+enum png_slot_state {
+    PNG_SLOT_EMPTY,
+    PNG_SLOT_READ,
+    PNG_SLOT_DONE
+};
+
+struct png_sequence_slot {
+    struct png_buffer in;
+    struct png_buffer out;
+    int state;
+    int err;
+};
+
+struct png_sequence {
+    struct png_stats stats;
+    size_t frame_len;
+    const char *output_template;
+    const struct png_opts *opts;
+    struct png_effects effects;
+    png_compress_fn compress;
+
+    struct png_sequence_slot *slots;
+    size_t count;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    size_t read;
+    size_t next;
+    _Bool stop;
+};
+
+static void png_sequence_path(char *path, size_t size, const char *template, size_t n) {
+    const char *mark = strstr(template, "{n}");
+
+    snprintf(path, size, "%.*s%zu%s", (int) (mark - template), template, n, mark + 3);
+}
+
+static void png_sequence_swap(struct png_buffer *a, struct png_buffer *b) {
+    struct png_buffer temp = *a;
+    *a = *b;
+    *b = temp;
+}
+
+static int png_sequence_frame(struct png_ctx *ctx, const struct png_sequence *seq, struct png_sequence_slot *slot,
+                              size_t n) {
+    const struct png_opts *opts = seq->opts;
+    const unsigned char *pixels;
+    char path[4096];
+    size_t len;
+    int err;
+
+    ctx->effects.salt = n;
+    if (opts->filter_method > PNG_FILTER_PAETH) {
+        err = png_filter_image_adaptive(ctx, slot->in.data, seq->frame_len, &seq->stats, opts->filter_method, &ctx->filtered);
+    } else {
+        err = png_filter_image_fixed(ctx, slot->in.data, seq->frame_len, &seq->stats, opts->filter_method, &ctx->filtered);
+    }
+    if (PNG_OK != err) {
+        return err;
+    }
+
+    if (NULL == seq->output_template) {
+        if (PNG_OK != (err = png_raw_decode(ctx, &seq->stats, &pixels, &len))) {
+            return err;
+        }
+        png_sequence_swap(&slot->out, pixels == ctx->image.data ? &ctx->image : &ctx->output);
+        slot->out.len = len;
+        return PNG_OK;
+    }
+
+    if (PNG_OK != (err = seq->compress(ctx, ctx->filtered.data, ctx->filtered.len, &ctx->compressed))) {
+        return err;
+    }
+    png_effects_corrupt(&ctx->effects, ctx->compressed.data, ctx->compressed.len, 0);
+
+    png_sequence_path(path, sizeof(path), seq->output_template, n);
+    slot->out.len = 0;
+
+    return png_emit_image(ctx, path, &ctx->index, NULL, ctx->compressed.data, ctx->compressed.len, 1 << 16,
+                          opts->mmap_output);
+}
+
+static void *png_sequence_worker(void *arg) {
+    struct png_sequence *seq = (struct png_sequence *) arg;
+    struct png_ctx *ctx = png_ctx_create();
+    struct png_sequence_slot *slot;
+    size_t n;
+
+    if (NULL != ctx) {
+        png_raw_skeleton(ctx, &seq->stats);
+        png_index_parse(&ctx->index);
+        ctx->effects = seq->effects;
+    }
+
+    pthread_mutex_lock(&seq->lock);
+    for (;;) {
+        while (seq->next == seq->read && !seq->stop) {
+            pthread_cond_wait(&seq->cond, &seq->lock);
+        }
+        if (seq->next == seq->read) {
+            break;
+        }
+
+        n = seq->next++;
+        slot = &seq->slots[n % seq->count];
+        pthread_mutex_unlock(&seq->lock);
+
+        slot->err = NULL == ctx ? PNG_ERR_NOMEM : png_sequence_frame(ctx, seq, slot, n);
+
+        pthread_mutex_lock(&seq->lock);
+        slot->state = PNG_SLOT_DONE;
+        pthread_cond_broadcast(&seq->cond);
+    }
+    pthread_mutex_unlock(&seq->lock);
+
+    png_ctx_destroy(ctx);
+    return NULL;
+}
+
+static size_t png_sequence_read(int fd, unsigned char *buffer, size_t len) {
+    size_t done = 0;
+    ssize_t got;
+
+    while (done < len) {
+        got = read(fd, buffer + done, len - done);
+        if (got == 0 || (got < 0 && errno != EINTR)) {
+            break;
+        }
+        if (got > 0) {
+            done += got;
+        }
+    }
+
+    return done;
+}
+
+int png_glitch_sequence(const char *format, int in_fd, int out_fd, const char *output_template, unsigned int threads,
+                        const struct png_opts *opts, size_t *frames) {
+
+    struct png_sequence seq;
+    struct png_sequence_slot *slot;
+    pthread_t *workers;
+    size_t i, started, written = 0, got;
+    _Bool eof = 0;
+    int err = PNG_OK;
+
+    if (NULL == format || NULL == opts || opts->filter_method > PNG_FILTER_ENTROPY) {
+        return PNG_ERR_ARG;
+    }
+    /* frames finish out of order, so each one needs its own file */
+    if (NULL != output_template && strcmp(output_template, "-") && NULL == strstr(output_template, "{n}")) {
+        return PNG_ERR_ARG;
+    }
+
+    memset(&seq, 0, sizeof(seq));
+    if (PNG_OK != (err = png_raw_stats(format, &seq.stats))) {
+        return err;
+    }
+    if (seq.stats.height > SIZE_MAX / png_row_stride(&seq.stats)) {
+        return PNG_ERR_IHDR;
+    }
+    seq.frame_len = png_row_stride(&seq.stats) * seq.stats.height;
+    seq.output_template = NULL == output_template || !strcmp(output_template, "-") ? NULL : output_template;
+    seq.opts = opts;
+    seq.compress = opts->preview ? png_preview_compress : png_zlib_compress;
+    if (PNG_OK != (err = png_effects_parse(&seq.effects, opts->effects, &seq.stats))) {
+        return err;
+    }
+
+    if (threads == 0) {
+        threads = 1;
+    }
+    seq.count = 2 * threads;
+
+    seq.slots = (struct png_sequence_slot *) calloc(seq.count, sizeof(*seq.slots));
+    workers = (pthread_t *) calloc(threads, sizeof(*workers));
+    if (NULL == seq.slots || NULL == workers) {
+        free(seq.slots);
+        free(workers);
+        return PNG_ERR_NOMEM;
+    }
+
+    pthread_mutex_init(&seq.lock, NULL);
+    pthread_cond_init(&seq.cond, NULL);
+
+    for (started = 0; started < threads; started++) {
+        if (pthread_create(&workers[started], NULL, png_sequence_worker, &seq) != 0) {
+            break;
+        }
+    }
+    if (started == 0) {
+        err = PNG_ERR_NOMEM;
+        eof = 1;
+    }
+
+    pthread_mutex_lock(&seq.lock);
+    while (!eof || written < seq.read) {
+        slot = &seq.slots[written % seq.count];
+        if (written < seq.read && slot->state == PNG_SLOT_DONE) {
+            pthread_mutex_unlock(&seq.lock);
+
+            if (PNG_OK == err && PNG_OK != slot->err) {
+                err = slot->err;
+                eof = 1;
+            }
+            if (PNG_OK == err && slot->out.len && !png_write_all(out_fd, slot->out.data, slot->out.len)) {
+                err = PNG_ERR_IO;
+                eof = 1;
+            }
+
+            pthread_mutex_lock(&seq.lock);
+            slot->state = PNG_SLOT_EMPTY;
+            written++;
+            continue;
+        }
+
+        if (!eof && seq.read - written < seq.count) {
+            slot = &seq.slots[seq.read % seq.count];
+            pthread_mutex_unlock(&seq.lock);
+
+            if (!png_buffer_reserve(&slot->in, seq.frame_len)) {
+                err = PNG_ERR_NOMEM;
+                eof = 1;
+            } else if ((got = png_sequence_read(in_fd, slot->in.data, seq.frame_len)) < seq.frame_len) {
+                err = got ? PNG_ERR_TRUNCATED : PNG_OK;
+                eof = 1;
+            }
+
+            pthread_mutex_lock(&seq.lock);
+            if (!eof) {
+                slot->state = PNG_SLOT_READ;
+                seq.read++;
+                pthread_cond_broadcast(&seq.cond);
+            }
+            continue;
+        }
+
+        pthread_cond_wait(&seq.cond, &seq.lock);
+    }
+    seq.stop = 1;
+    pthread_cond_broadcast(&seq.cond);
+    pthread_mutex_unlock(&seq.lock);
+
+    for (i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+
+    for (i = 0; i < seq.count; i++) {
+        png_buffer_free(&seq.slots[i].in);
+        png_buffer_free(&seq.slots[i].out);
+    }
+    free(seq.slots);
+    free(workers);
+    pthread_cond_destroy(&seq.cond);
+    pthread_mutex_destroy(&seq.lock);
+
+    if (NULL != frames) {
+        *frames = written;
+    }
+
+    return err;
+}
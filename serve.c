@@ -0,0 +1,519 @@
+#include "png.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+
+#define PNG_SERVE_LINE 16384
+
+struct png_serve_conn {
+    int in_fd;
+    int out_fd;
+    pthread_mutex_t write_lock;
+    unsigned int refs;
+    struct png_serve *serve;
+};
+
+struct png_serve_job {
+    struct png_serve_conn *conn;
+    char id[128];
+    char input[4096];
+    char shm[256];
+    size_t shm_size;
+    char output[4096];
+    char raw_format[64];
+    char effects[256];
+    struct png_opts opts;
+    double received;
+    struct png_serve_job *next;
+};
+
+struct png_serve {
+    const struct png_opts *opts;
+
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    pthread_cond_t space;
+    struct png_serve_job *head;
+    struct png_serve_job *tail;
+    unsigned int inflight;
+    unsigned int max_inflight;
+    _Bool stopping;
+};
+
+static double png_serve_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+static void png_serve_reply(struct png_serve_conn *conn, const char *line, size_t len) {
+    pthread_mutex_lock(&conn->write_lock);
+    png_write_all(conn->out_fd, (const unsigned char *) line, len);
+    pthread_mutex_unlock(&conn->write_lock);
+}
+
+static void png_serve_release(struct png_serve_conn *conn) {
+    struct png_serve *serve = conn->serve;
+    unsigned int refs;
+
+    pthread_mutex_lock(&serve->lock);
+    refs = --conn->refs;
+    pthread_mutex_unlock(&serve->lock);
+
+    if (refs > 0) {
+        return;
+    }
+
+    if (conn->in_fd != STDIN_FILENO) {
+        close(conn->in_fd);
+    }
+    pthread_mutex_destroy(&conn->write_lock);
+    free(conn);
+}
+
+static void png_serve_fail(struct png_serve_conn *conn, const char *id, const char *error) {
+    char line[512], id_esc[256];
+    int len = snprintf(line, sizeof(line), "{\"id\":\"%s\",\"ok\":false,\"error\":\"%s\"}\n",
+                       png_json_escape(id_esc, sizeof(id_esc), id), error);
+    png_serve_reply(conn, line, (size_t) len < sizeof(line) ? (size_t) len : sizeof(line) - 1);
+}
+
+static const char *png_serve_string(const char *p, char *out, size_t size) {
+    size_t len = 0;
+
+    for (p++; *p && *p != '"'; p++) {
+        if (*p == '\\' && p[1]) {
+            p++;
+            switch (*p) {
+                case 'n':
+                    out[len] = '\n';
+                    break;
+                case 't':
+                    out[len] = '\t';
+                    break;
+                default:
+                    out[len] = *p;
+                    break;
+            }
+        } else {
+            out[len] = *p;
+        }
+        if (len + 1 < size) {
+            len++;
+        }
+    }
+    out[len] = '\0';
+
+    return *p == '"' ? p + 1 : NULL;
+}
+
+static void png_serve_copy(char *out, size_t size, const char *value) {
+    size_t len = strlen(value);
+
+    if (len >= size) {
+        len = size - 1;
+    }
+    memcpy(out, value, len);
+    out[len] = '\0';
+}
+
+static _Bool png_serve_parse(const char *line, struct png_serve_job *job) {
+    char key[64], value[4096];
+    const char *p = line;
+
+    while (isspace((unsigned char) *p)) {
+        p++;
+    }
+    if (*p++ != '{') {
+        return 0;
+    }
+
+    for (;;) {
+        while (isspace((unsigned char) *p) || *p == ',') {
+            p++;
+        }
+        if (*p == '}') {
+            return 1;
+        }
+        if (*p != '"' || NULL == (p = png_serve_string(p, key, sizeof(key)))) {
+            return 0;
+        }
+
+        while (isspace((unsigned char) *p)) {
+            p++;
+        }
+        if (*p++ != ':') {
+            return 0;
+        }
+        while (isspace((unsigned char) *p)) {
+            p++;
+        }
+
+        if (*p == '"') {
+            if (NULL == (p = png_serve_string(p, value, sizeof(value)))) {
+                return 0;
+            }
+        } else {
+            size_t len = strcspn(p, ",} \t\r\n");
+            if (len == 0 || len >= sizeof(value)) {
+                return 0;
+            }
+            memcpy(value, p, len);
+            value[len] = '\0';
+            p += len;
+        }
+
+        if (!strcmp(key, "id")) {
+            png_serve_copy(job->id, sizeof(job->id), value);
+        } else if (!strcmp(key, "input")) {
+            png_serve_copy(job->input, sizeof(job->input), value);
+        } else if (!strcmp(key, "shm")) {
+            png_serve_copy(job->shm, sizeof(job->shm), value);
+        } else if (!strcmp(key, "size")) {
+            job->shm_size = strtoull(value, NULL, 10);
+        } else if (!strcmp(key, "output")) {
+            png_serve_copy(job->output, sizeof(job->output), value);
+        } else if (!strcmp(key, "filter")) {
+            job->opts.filter_method = (unsigned char) png_filter_policy(value);
+        } else if (!strcmp(key, "stream")) {
+            job->opts.stream = !strcmp(value, "true");
+        } else if (!strcmp(key, "deflate_threads")) {
+            job->opts.deflate_threads = strtoul(value, NULL, 10);
+        } else if (!strcmp(key, "filter_threads")) {
+            job->opts.filter_threads = strtoul(value, NULL, 10);
+        } else if (!strcmp(key, "block_size")) {
+            job->opts.block_size = strtoul(value, NULL, 10) << 10;
+        } else if (!strcmp(key, "race_ms")) {
+            job->opts.race = 1;
+            job->opts.race_budget_ms = strtoul(value, NULL, 10);
+        } else if (!strcmp(key, "mmap_output")) {
+            job->opts.mmap_output = !strcmp(value, "true");
+        } else if (!strcmp(key, "progressive")) {
+            job->opts.progressive = !strcmp(value, "true");
+        } else if (!strcmp(key, "raw")) {
+            png_serve_copy(job->raw_format, sizeof(job->raw_format), value);
+            job->opts.raw_format = job->raw_format;
+        } else if (!strcmp(key, "effects")) {
+            png_serve_copy(job->effects, sizeof(job->effects), value);
+            job->opts.effects = job->effects;
+        } else if (!strcmp(key, "pipeline")) {
+            job->opts.pipeline = !strcmp(value, "true");
+        } else if (!strcmp(key, "preview")) {
+            job->opts.preview = !strcmp(value, "true");
+        }
+    }
+}
+
+static int png_serve_shm(struct png_ctx *ctx, const struct png_serve_job *job, size_t *bytes_in, size_t *bytes_out) {
+    const unsigned char *output;
+    struct png_output out;
+    struct stat st;
+    void *map;
+    size_t size;
+    int fd, err;
+
+    /* shared memory goes through png_glitch_buffer, which only reads and writes PNG */
+    if (NULL != job->opts.raw_format || PNG_RAW_NONE != png_raw_kind(job->output)) {
+        return PNG_ERR_ARG;
+    }
+
+    if ((fd = shm_open(job->shm, O_RDONLY, 0)) == -1) {
+        return PNG_ERR_IO;
+    }
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return PNG_ERR_IO;
+    }
+
+    size = job->shm_size ? job->shm_size : (size_t) st.st_size;
+    if (size == 0 || size > (size_t) st.st_size) {
+        close(fd);
+        return PNG_ERR_ARG;
+    }
+
+    map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (MAP_FAILED == map) {
+        return PNG_ERR_IO;
+    }
+    *bytes_in = size;
+
+    err = png_glitch_buffer(ctx, (const unsigned char *) map, size, &output, bytes_out, &job->opts);
+    munmap(map, size);
+
+    if (PNG_OK != err) {
+        return err;
+    }
+
+    if (PNG_OK != (err = png_output_begin(&out, job->output))) {
+        return err;
+    }
+    if (!png_write_all(out.fd, output, *bytes_out)) {
+        err = PNG_ERR_IO;
+    }
+
+    return png_output_end(&out, err);
+}
+
+static void png_serve_run(struct png_ctx *ctx, struct png_serve_job *job) {
+    char line[1024], id_esc[256];
+    const char *config;
+    double start = png_serve_now(), end;
+    size_t bytes_in = 0, bytes_out = 0;
+    struct stat st;
+    int err, len;
+
+    if (job->shm[0]) {
+        err = png_serve_shm(ctx, job, &bytes_in, &bytes_out);
+    } else {
+        err = png_glitch_file(ctx, job->input, job->output, &job->opts);
+        if (PNG_OK == err && stat(job->input, &st) == 0) {
+            bytes_in = (size_t) st.st_size;
+        }
+        if (PNG_OK == err && stat(job->output, &st) == 0) {
+            bytes_out = (size_t) st.st_size;
+        }
+    }
+
+    end = png_serve_now();
+    config = PNG_OK == err && job->opts.race ? png_ctx_deflate_config(ctx) : NULL;
+
+    len = snprintf(line, sizeof(line),
+                   "{\"id\":\"%s\",\"ok\":%s,\"error\":%s%s%s,\"bytes_in\":%zu,\"bytes_out\":%zu,"
+                   "\"queue_ms\":%.3f,\"run_ms\":%.3f,\"latency_ms\":%.3f%s%s%s}\n",
+                   png_json_escape(id_esc, sizeof(id_esc), job->id), PNG_OK == err ? "true" : "false",
+                   PNG_OK == err ? "" : "\"", PNG_OK == err ? "null" : png_strerror(err), PNG_OK == err ? "" : "\"",
+                   bytes_in, bytes_out,
+                   (start - job->received) * 1e3, (end - start) * 1e3, (end - job->received) * 1e3,
+                   config ? ",\"deflate_config\":\"" : "", config ? config : "", config ? "\"" : "");
+
+    png_serve_reply(job->conn, line, (size_t) len < sizeof(line) ? (size_t) len : sizeof(line) - 1);
+}
+
+static void *png_serve_worker(void *arg) {
+    struct png_serve *serve = (struct png_serve *) arg;
+    struct png_ctx *ctx = png_ctx_create();
+    struct png_serve_job *job;
+
+    CHALLOC(ctx)
+
+    for (;;) {
+        pthread_mutex_lock(&serve->lock);
+        while (NULL == serve->head && !serve->stopping) {
+            pthread_cond_wait(&serve->ready, &serve->lock);
+        }
+        if (NULL == (job = serve->head)) {
+            pthread_mutex_unlock(&serve->lock);
+            break;
+        }
+        serve->head = job->next;
+        if (NULL == serve->head) {
+            serve->tail = NULL;
+        }
+        pthread_mutex_unlock(&serve->lock);
+
+        png_serve_run(ctx, job);
+
+        pthread_mutex_lock(&serve->lock);
+        serve->inflight--;
+        pthread_cond_signal(&serve->space);
+        pthread_mutex_unlock(&serve->lock);
+
+        png_serve_release(job->conn);
+        free(job);
+    }
+
+    png_ctx_destroy(ctx);
+    return NULL;
+}
+
+static void png_serve_submit(struct png_serve_conn *conn, const char *line) {
+    struct png_serve *serve = conn->serve;
+    struct png_serve_job *job = (struct png_serve_job *) calloc(1, sizeof(*job));
+    CHALLOC(job)
+
+    job->received = png_serve_now();
+    job->conn = conn;
+    job->opts = *serve->opts;
+
+    if (!png_serve_parse(line, job)) {
+        png_serve_fail(conn, job->id, "Malformed request");
+        free(job);
+        return;
+    }
+    if ((!job->input[0] && !job->shm[0]) || !job->output[0]) {
+        png_serve_fail(conn, job->id, "Request needs an input or shm and an output");
+        free(job);
+        return;
+    }
+
+    pthread_mutex_lock(&serve->lock);
+    while (serve->inflight >= serve->max_inflight) {
+        pthread_cond_wait(&serve->space, &serve->lock);
+    }
+    serve->inflight++;
+    conn->refs++;
+    if (NULL == serve->tail) {
+        serve->head = job;
+    } else {
+        serve->tail->next = job;
+    }
+    serve->tail = job;
+    pthread_cond_signal(&serve->ready);
+    pthread_mutex_unlock(&serve->lock);
+}
+
+static void *png_serve_reader(void *arg) {
+    struct png_serve_conn *conn = (struct png_serve_conn *) arg;
+    char buffer[PNG_SERVE_LINE];
+    size_t filled = 0, start, i;
+    _Bool overlong = 0;
+    ssize_t got;
+
+    for (;;) {
+        if ((got = read(conn->in_fd, buffer + filled, sizeof(buffer) - filled)) < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            break;
+        }
+        filled += (size_t) got;
+
+        for (start = 0, i = 0; i < filled; i++) {
+            if (buffer[i] != '\n') {
+                continue;
+            }
+            buffer[i] = '\0';
+            if (overlong) {
+                png_serve_fail(conn, "", "Request line too long");
+                overlong = 0;
+            } else if (i > start) {
+                png_serve_submit(conn, buffer + start);
+            }
+            start = i + 1;
+        }
+
+        memmove(buffer, buffer + start, filled - start);
+        filled -= start;
+        if (filled == sizeof(buffer)) {
+            overlong = 1;
+            filled = 0;
+        }
+    }
+
+    png_serve_release(conn);
+    return NULL;
+}
+
+static struct png_serve_conn *png_serve_conn(struct png_serve *serve, int in_fd, int out_fd) {
+    struct png_serve_conn *conn = (struct png_serve_conn *) calloc(1, sizeof(*conn));
+    CHALLOC(conn)
+
+    conn->in_fd = in_fd;
+    conn->out_fd = out_fd;
+    conn->refs = 1;
+    conn->serve = serve;
+    pthread_mutex_init(&conn->write_lock, NULL);
+
+    return conn;
+}
+
+static int png_serve_listen(const char *path) {
+    struct sockaddr_un addr;
+    int fd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path '%s' is too long\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+        fputs("Failed to create socket\n", stderr);
+        return -1;
+    }
+
+    unlink(path);
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1 || listen(fd, 64) == -1) {
+        fprintf(stderr, "Failed to listen on '%s'\n", path);
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+int png_serve(const char *socket_path, unsigned int threads, unsigned int max_inflight, const struct png_opts *opts) {
+    struct png_serve serve;
+    pthread_t *workers, reader;
+    unsigned int i;
+    int listen_fd, fd;
+
+    signal(SIGPIPE, SIG_IGN);
+
+    memset(&serve, 0, sizeof(serve));
+    serve.opts = opts;
+    serve.max_inflight = max_inflight ? max_inflight : 1;
+    pthread_mutex_init(&serve.lock, NULL);
+    pthread_cond_init(&serve.ready, NULL);
+    pthread_cond_init(&serve.space, NULL);
+
+    if (threads == 0) {
+        threads = 1;
+    }
+
+    workers = (pthread_t *) calloc(threads, sizeof(*workers));
+    CHALLOC(workers)
+
+    for (i = 0; i < threads; i++) {
+        if (pthread_create(&workers[i], NULL, png_serve_worker, &serve) != 0) {
+            fputs("Failed to start worker thread\n", stderr);
+            exit(1);
+        }
+    }
+
+    if (!strcmp(socket_path, "-")) {
+        png_serve_reader(png_serve_conn(&serve, STDIN_FILENO, STDOUT_FILENO));
+    } else if ((listen_fd = png_serve_listen(socket_path)) != -1) {
+        fprintf(stderr, "Serving on '%s' with %u threads\n", socket_path, threads);
+        for (;;) {
+            if ((fd = accept(listen_fd, NULL, NULL)) == -1) {
+                if (errno == EINTR || errno == ECONNABORTED) {
+                    continue;
+                }
+                break;
+            }
+            if (pthread_create(&reader, NULL, png_serve_reader, png_serve_conn(&serve, fd, fd)) != 0) {
+                close(fd);
+                continue;
+            }
+            pthread_detach(reader);
+        }
+        close(listen_fd);
+        unlink(socket_path);
+    }
+
+    pthread_mutex_lock(&serve.lock);
+    serve.stopping = 1;
+    pthread_cond_broadcast(&serve.ready);
+    pthread_mutex_unlock(&serve.lock);
+
+    for (i = 0; i < threads; i++) {
+        pthread_join(workers[i], NULL);
+    }
+
+    free(workers);
+    pthread_cond_destroy(&serve.space);
+    pthread_cond_destroy(&serve.ready);
+    pthread_mutex_destroy(&serve.lock);
+
+    return 0;
+}
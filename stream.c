@@ -0,0 +1,175 @@
+#include "png.h"
+
+#define PNG_IDAT_MAX (1 << 16)
+
+static const unsigned char png_channels[7] = {1, 0, 3, 1, 2, 0, 4};
+
+unsigned int png_pixel_bits(const struct png_stats *stats) {
+    return png_channels[stats->color_type] * stats->bit_depth;
+}
+
+size_t png_row_stride(const struct png_stats *stats) {
+    return ((size_t) stats->width * png_pixel_bits(stats) + 7) / 8;
+}
+
+static int png_stream_deflate(struct png_ctx *ctx, int fd, unsigned char *idat, int flush) {
+    z_stream *stream = &ctx->deflate_strm;
+    int ret;
+
+    do {
+        if (stream->avail_out == 0) {
+            png_effects_corrupt(&ctx->effects, idat, PNG_IDAT_MAX, stream->total_out - PNG_IDAT_MAX);
+            if (!png_write_chunk(fd, (const unsigned char *) "IDAT", idat, PNG_IDAT_MAX)) {
+                return PNG_ERR_IO;
+            }
+            stream->next_out = idat;
+            stream->avail_out = PNG_IDAT_MAX;
+        }
+
+        ret = deflate(stream, flush);
+        if (Z_STREAM_ERROR == ret) {
+            return PNG_ERR_ZLIB;
+        }
+    } while (flush == Z_FINISH ? ret != Z_STREAM_END : stream->avail_out == 0);
+
+    return PNG_OK;
+}
+
+_Bool png_stream_copy(int fd, const struct png_index *index, size_t from, size_t to) {
+    if (from >= to) {
+        return 1;
+    }
+    return png_write_all(fd, index->base + index->chunks[from].offset,
+                         index->chunks[to - 1].offset + index->chunks[to - 1].len + 12 - index->chunks[from].offset);
+}
+
+int png_stream_glitch(struct png_ctx *ctx, const struct png_index *index, const struct png_stats *stats, int fd, unsigned char filter_method) {
+
+    size_t stride = png_row_stride(stats);
+    size_t row_len = stride + 1;
+    size_t band_rows = CHUNK / row_len ? CHUNK / row_len : 1;
+    size_t band_len = band_rows * row_len;
+
+    unsigned char *band = (unsigned char *) png_arena_calloc(&ctx->arena, band_len);
+    unsigned char *filtered = (unsigned char *) png_arena_calloc(&ctx->arena, band_len);
+    unsigned char *prev = (unsigned char *) png_arena_calloc(&ctx->arena, row_len);
+    unsigned char *idat = (unsigned char *) png_arena_calloc(&ctx->arena, PNG_IDAT_MAX);
+
+    z_stream *inflate_strm = &ctx->inflate_strm;
+    z_stream *deflate_strm = &ctx->deflate_strm;
+    size_t chunk = index->idat_first;
+    const unsigned char *row, *above;
+    png_unfilter_fn kernels[5];
+    png_filter_fn kernel = filter_method > PNG_FILTER_PAETH ? NULL : png_filter_kernel(filter_method, stats->bit_depth);
+    size_t filled = 0, rows, r;
+    uint32_t h = 0;
+    int ret = Z_OK, err = PNG_OK;
+
+    if (NULL == band || NULL == filtered || NULL == prev || NULL == idat ||
+        ((filter_method > PNG_FILTER_PAETH || ctx->effects.active) && !png_buffer_reserve(&ctx->candidates, 5 * stride))) {
+        return PNG_ERR_NOMEM;
+    }
+
+    png_unfilter_kernels(stats->bit_depth, kernels);
+    inflateReset(inflate_strm);
+    deflateReset(deflate_strm);
+    deflate_strm->next_out = idat;
+    deflate_strm->avail_out = PNG_IDAT_MAX;
+
+    if (!png_stream_copy(fd, index, 0, index->idat_first)) {
+        return PNG_ERR_IO;
+    }
+
+    inflate_strm->avail_in = 0;
+
+    while (h < stats->height && ret != Z_STREAM_END) {
+        if (inflate_strm->avail_in == 0) {
+            while (chunk < index->idat_last && memcmp(index->chunks[chunk].type, "IDAT", 4) != 0) {
+                chunk++;
+            }
+            if (chunk == index->idat_last) {
+                break;
+            }
+            inflate_strm->next_in = (unsigned char *) index->chunks[chunk].data;
+            inflate_strm->avail_in = index->chunks[chunk].len;
+            chunk++;
+        }
+
+        inflate_strm->next_out = band + filled;
+        inflate_strm->avail_out = band_len - filled;
+
+        ret = inflate(inflate_strm, Z_NO_FLUSH);
+        switch (ret) {
+            case Z_NEED_DICT:
+            case Z_STREAM_ERROR:
+            case Z_DATA_ERROR:
+                return PNG_ERR_ZLIB;
+            case Z_MEM_ERROR:
+                return PNG_ERR_NOMEM;
+            default:
+                break;
+        }
+
+        filled = band_len - inflate_strm->avail_out;
+        rows = filled / row_len;
+        if (rows > stats->height - h) {
+            rows = stats->height - h;
+        }
+
+        for (r = 0; r < rows; r++) {
+            row = band + r * row_len;
+            above = r ? row - row_len + 1 : prev;
+            PNG_TRACE_FILTER(row[0])
+            if (row[0] > PNG_FILTER_PAETH) {
+                return PNG_ERR_FILTER;
+            }
+            kernels[row[0]](band + r * row_len + 1, above, stride, stats->bit_depth);
+            if (ctx->effects.active) {
+                png_effects_row(&ctx->effects, h + r, filtered + r * row_len, row + 1, above, stride, stats->bit_depth,
+                                filter_method, ctx->candidates.data);
+            } else if (filter_method > PNG_FILTER_PAETH) {
+                png_filter_row_adaptive(filtered + r * row_len, row + 1, above, stride, stats->bit_depth, filter_method,
+                                        ctx->candidates.data);
+            } else {
+                filtered[r * row_len] = filter_method;
+                kernel(filtered + r * row_len + 1, row + 1, above, stride, stats->bit_depth);
+            }
+        }
+
+        if (rows) {
+            memcpy(prev, band + (rows - 1) * row_len + 1, stride);
+            memmove(band, band + rows * row_len, filled - rows * row_len);
+            filled -= rows * row_len;
+            h += rows;
+
+            deflate_strm->next_in = filtered;
+            deflate_strm->avail_in = rows * row_len;
+            if (PNG_OK != (err = png_stream_deflate(ctx, fd, idat, Z_NO_FLUSH))) {
+                return err;
+            }
+        }
+    }
+
+    if (h < stats->height) {
+        return PNG_ERR_TRUNCATED;
+    }
+
+    deflate_strm->avail_in = 0;
+    if (PNG_OK != (err = png_stream_deflate(ctx, fd, idat, Z_FINISH))) {
+        return err;
+    }
+
+    png_effects_corrupt(&ctx->effects, idat, PNG_IDAT_MAX - deflate_strm->avail_out,
+                        deflate_strm->total_out - (PNG_IDAT_MAX - deflate_strm->avail_out));
+    if (!png_write_chunk(fd, (const unsigned char *) "IDAT", idat, PNG_IDAT_MAX - deflate_strm->avail_out) ||
+        !png_stream_copy(fd, index, index->idat_last, index->count)) {
+        return PNG_ERR_IO;
+    }
+
+    if (png_trace_active) {
+        png_trace_active->raw_bytes = (size_t) stats->height * stride;
+        png_trace_active->compressed_bytes = deflate_strm->total_out;
+    }
+
+    return PNG_OK;
+}
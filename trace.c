@@ -0,0 +1,124 @@
+#include "png.h"
+
+#include <time.h>
+
+__thread struct png_trace *png_trace_active;
+
+static const char *png_stage_names[PNG_STAGE_COUNT] = {
+        "parse", "inflate", "unfilter", "refilter", "deflate", "write", "stream", "cache"
+};
+
+static double png_trace_clock(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+void png_trace_start(struct png_trace *trace) {
+    memset(trace, 0, sizeof(*trace));
+    trace->current = -1;
+    trace->wall = png_trace_clock(CLOCK_MONOTONIC);
+    png_trace_active = trace;
+}
+
+void png_trace_stop(struct png_trace *trace) {
+    trace->wall = png_trace_clock(CLOCK_MONOTONIC) - trace->wall;
+    png_trace_active = NULL;
+}
+
+void png_trace_begin(int stage, size_t bytes_in) {
+    struct png_trace *trace = png_trace_active;
+
+    trace->current = stage;
+    trace->stage[stage].bytes_in += bytes_in;
+    trace->stage[stage].wall -= png_trace_clock(CLOCK_MONOTONIC);
+    trace->stage[stage].cpu -= png_trace_clock(CLOCK_THREAD_CPUTIME_ID);
+}
+
+void png_trace_end(int stage, size_t bytes_out) {
+    struct png_trace *trace = png_trace_active;
+
+    trace->stage[stage].wall += png_trace_clock(CLOCK_MONOTONIC);
+    trace->stage[stage].cpu += png_trace_clock(CLOCK_THREAD_CPUTIME_ID);
+    trace->stage[stage].bytes_out += bytes_out;
+    trace->stage[stage].runs++;
+    trace->current = -1;
+}
+
+void png_trace_alloc(size_t size, _Bool is_realloc) {
+    struct png_trace *trace = png_trace_active;
+    struct png_stage_trace *stage;
+
+    if (trace->current < 0) {
+        return;
+    }
+
+    stage = &trace->stage[trace->current];
+    if (is_realloc) {
+        stage->reallocs++;
+    } else {
+        stage->allocs++;
+    }
+    if (size > stage->peak) {
+        stage->peak = size;
+    }
+}
+
+const char *png_json_escape(char *buffer, size_t size, const char *text) {
+    size_t len = 0;
+
+    for (; *text && len + 3 < size; text++) {
+        if (*text == '"' || *text == '\\') {
+            buffer[len++] = '\\';
+        }
+        buffer[len++] = (char) ((unsigned char) *text < 0x20 ? '?' : *text);
+    }
+    buffer[len] = '\0';
+
+    return buffer;
+}
+
+void png_trace_report(const struct png_trace *trace, const char *input, const char *output) {
+    char line[4096], input_esc[1024], output_esc[1024];
+    size_t len = 0;
+    int s;
+
+#define APPEND(...) len += (size_t) snprintf(line + len, len < sizeof(line) ? sizeof(line) - len : 0, __VA_ARGS__)
+
+    APPEND("{\"input\":\"%s\",\"output\":\"%s\",\"ok\":%s,\"width\":%u,\"height\":%u,\"bit_depth\":%u,\"color_type\":%u,"
+           "\"bytes_in\":%zu,\"bytes_out\":%zu,\"raw_bytes\":%zu,\"compressed_bytes\":%zu,\"compression_ratio\":%.4f,"
+           "\"wall_s\":%.6f,\"stages\":{",
+           png_json_escape(input_esc, sizeof(input_esc), input), png_json_escape(output_esc, sizeof(output_esc), output),
+           trace->ok ? "true" : "false", trace->width, trace->height, trace->bit_depth, trace->color_type,
+           trace->bytes_in, trace->bytes_out, trace->raw_bytes, trace->compressed_bytes,
+           trace->compressed_bytes ? (double) trace->raw_bytes / (double) trace->compressed_bytes : 0.0, trace->wall);
+
+    for (s = 0; s < PNG_STAGE_COUNT; s++) {
+        const struct png_stage_trace *stage = &trace->stage[s];
+        if (stage->runs == 0) {
+            continue;
+        }
+        APPEND("%s\"%s\":{\"wall_s\":%.6f,\"cpu_s\":%.6f,\"bytes_in\":%zu,\"bytes_out\":%zu,"
+               "\"allocs\":%zu,\"reallocs\":%zu,\"peak_buffer\":%zu}",
+               line[len - 1] == '{' ? "" : ",", png_stage_names[s], stage->wall, stage->cpu,
+               stage->bytes_in, stage->bytes_out, stage->allocs, stage->reallocs, stage->peak);
+    }
+
+    APPEND("},\"filter_histogram\":[%zu,%zu,%zu,%zu,%zu]",
+           trace->filter_hist[0], trace->filter_hist[1], trace->filter_hist[2], trace->filter_hist[3], trace->filter_hist[4]);
+    if (trace->deflate_config) {
+        APPEND(",\"deflate_config\":\"%s\"", trace->deflate_config);
+    }
+    if (trace->cache) {
+        APPEND(",\"cache\":\"%s\"", trace->cache);
+    }
+    APPEND("}\n");
+
+#undef APPEND
+
+    if (len >= sizeof(line)) {
+        line[sizeof(line) - 2] = '\n';
+        line[sizeof(line) - 1] = '\0';
+    }
+    fputs(line, stderr);
+}